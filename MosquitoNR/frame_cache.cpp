@@ -0,0 +1,146 @@
+//------------------------------------------------------------------------------
+//		frame_cache.cpp
+//------------------------------------------------------------------------------
+
+/*
+	Output cache of duplicate frames.
+
+	The luma of the region in the source frame (luma and chroma of YUY2), followed by the region
+	of the mask frame when mask is given, is hashed to 128 bits,
+	16 bytes at a time in the manner of XXH3: each block is xored with a key, its 32-bit halves
+	are multiplied, and the products and the blocks are accumulated in two 64-bit lanes.
+	The accumulators are scrambled at the end of each row, so the position of a row matters.
+
+	The cache keeps the output frames of the last frames (least recently used one is replaced).
+	When both the hash and the parameters match, the luma of the cached output is copied
+	instead of processing the frame, and the script variables of the cached frame are published again.
+	Chroma is copied from the source as usual.
+*/
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+// keys of the blocks of a row (cycled) and the scrambler, 32 bits each
+static const unsigned hash_key[9][4] = {
+	{ 0xbe4ba423, 0x396cfeb8, 0x1cad21f7, 0x2ef6a90d }, { 0x7c01812c, 0xf721ad1c, 0xded46de9, 0x839097db },
+	{ 0x7240a4a4, 0xb7b3671f, 0xcb79e64e, 0xccc0e578 }, { 0x825ad07d, 0xccff7221, 0xb8084674, 0xf743248e },
+	{ 0xe03590e6, 0x813a264c, 0x3c2852bb, 0x91c300cb }, { 0x88d0658b, 0x1b532ea3, 0x71644897, 0xa20df94e },
+	{ 0x3819ef46, 0xa9deacd8, 0xa8fa763f, 0xe39c343f }, { 0xf9dcbbc7, 0xc70b4f1d, 0x8a51e04b, 0xcdb45931 },
+	{ 0xc89f7ec9, 0xd9787364, 0xeac5ac83, 0x34d3ebc3 },
+};
+static const unsigned prime32 = 0x9e3779b1;
+
+static inline __m128i LoadKey(int i)
+{
+	return _mm_loadu_si128((const __m128i*)hash_key[i]);
+}
+
+// acc += (lo32(v ^ key) * hi32(v ^ key)) + swapped v (per 64-bit lane)
+static inline __m128i Accumulate(__m128i acc, __m128i v, __m128i key)
+{
+	const __m128i data_key = _mm_xor_si128(v, key);
+	const __m128i product  = _mm_mul_epu32(data_key, _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+	return _mm_add_epi64(_mm_add_epi64(acc, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2))), product);
+}
+
+// acc = (acc ^ (acc >> 47) ^ key) * prime32 (per 64-bit lane)
+static inline __m128i Scramble(__m128i acc, __m128i key, __m128i prime)
+{
+	const __m128i a  = _mm_xor_si128(_mm_xor_si128(acc, _mm_srli_epi64(acc, 47)), key);
+	const __m128i lo = _mm_mul_epu32(a, prime);
+	const __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 1, 1)), prime);
+	return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+// rows of bytes -> the accumulators
+static void HashRows(__m128i& acc0, __m128i& acc1, const BYTE* srcp, int src_pitch, int row_size, int height)
+{
+	const __m128i prime = _mm_set1_epi32(prime32);
+	const __m128i scramble_key = LoadKey(8);
+	__declspec(align(16)) BYTE last[32];
+
+	for (int y = 0; y < height; ++y, srcp += src_pitch)
+	{
+		int x = 0, k = 0;
+		for (; x + 32 <= row_size; x += 32, k = (k + 2) & 7) {
+			acc0 = Accumulate(acc0, _mm_loadu_si128((const __m128i*)(srcp + x)),      LoadKey(k));
+			acc1 = Accumulate(acc1, _mm_loadu_si128((const __m128i*)(srcp + x + 16)), LoadKey(k + 1));
+		}
+		if (x < row_size) {
+			memset(last, 0, sizeof(last));
+			memcpy(last, srcp + x, row_size - x);
+			acc0 = Accumulate(acc0, _mm_load_si128((const __m128i*)(last)),      LoadKey(k));
+			acc1 = Accumulate(acc1, _mm_load_si128((const __m128i*)(last + 16)), LoadKey(k + 1));
+		}
+		acc0 = Scramble(acc0, scramble_key, prime);
+		acc1 = Scramble(acc1, scramble_key, prime);
+	}
+}
+
+void MosquitoNR::HashSource(unsigned __int64 hash[2])
+{
+	const int row_size = width * in_bytes;
+	__m128i acc0 = _mm_set_epi32(0, row_size, 0, height);
+	__m128i acc1 = _mm_set_epi32(0, prime32, 0, prime32);
+
+	HashRows(acc0, acc1, SrcLuma(), SrcFrame()->GetPitch(), row_size, height);
+
+	// the mask decides what is processed, so the output depends on it as well
+	if (mask) {
+		const int mask_pitch = mask_frame->GetPitch();
+		HashRows(acc0, acc1, mask_frame->GetReadPtr() + roi_y * mask_pitch + roi_x, mask_pitch, width, height);
+	}
+
+	// mix the 4 lanes to 2
+	__declspec(align(16)) unsigned __int64 a[2], b[2];
+	_mm_store_si128((__m128i*)a, acc0);
+	_mm_store_si128((__m128i*)b, acc1);
+	hash[0] = a[0] ^ (b[1] << 29 | b[1] >> 35);
+	hash[1] = a[1] ^ (b[0] << 29 | b[0] >> 35);
+}
+
+// parameters the output depends on (compared with the entries of the cache)
+int MosquitoNR::CacheParams() const
+{
+	return strength | restore << 8 | radius << 16;
+}
+
+// copy the luma of the cached output if the source was processed before
+bool MosquitoNR::CacheLookup(const unsigned __int64 hash[2], IScriptEnvironment* env)
+{
+	++cache_requests;
+
+	for (int i = 0; i < cache_size; ++i)
+	{
+		CacheEntry& e = cache[i];
+		if (!e.last_used || e.hash[0] != hash[0] || e.hash[1] != hash[1] || e.params != CacheParams()) continue;
+
+		const PVideoFrame& f = e.frame;
+		env->BitBlt(DstLuma(), dst->GetPitch(), f->GetReadPtr() + roi_y * f->GetPitch() + roi_x * out_bytes, f->GetPitch(),
+			width * out_bytes, stack * height);
+		e.last_used = ++cache_clock;
+		PublishStats(env, e.stats);
+		++cache_hits;
+		env->SetVar("MosquitoNR_cache_hit_rate", float(cache_hits) / cache_requests);
+		return true;
+	}
+
+	env->SetVar("MosquitoNR_cache_hit_rate", float(cache_hits) / cache_requests);
+	return false;
+}
+
+// keep the output frame in place of the least recently used entry
+void MosquitoNR::CacheStore(const unsigned __int64 hash[2])
+{
+	int oldest = 0;
+	for (int i = 1; i < cache_size; ++i)
+		if (cache[i].last_used < cache[oldest].last_used) oldest = i;
+
+	CacheEntry& e = cache[oldest];
+	e.hash[0]   = hash[0];
+	e.hash[1]   = hash[1];
+	e.params    = CacheParams();
+	e.last_used = ++cache_clock;
+	e.frame     = dst;
+	e.stats     = frame_stats;
+}
@@ -0,0 +1,185 @@
+//------------------------------------------------------------------------------
+//		lowpass.cpp
+//------------------------------------------------------------------------------
+
+/*
+	Restoring by a separable low-pass filter instead of the wavelet.
+
+		out = blurred + restore / 128 * (lowpass(original) - lowpass(blurred))
+		    = blurred + restore / 128 * lowpass(original - blurred)
+
+	The low-pass filter is a box of radius r = 2^(levels-1) ("box"), or the box applied twice
+	("gauss", a triangle close to a Gaussian). Both are running sums, so the cost per pixel
+	does not depend on r. The vertical pass runs 4 columns at a time, and the horizontal pass
+	adds the result to the blurred image.
+
+	buffers
+		lbuf  : vertical low-pass of the difference
+		fwork : running sums, the ring of the first box (2r+2 rows), 2 rows and a row of zeros
+*/
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+static inline int reflect(int i, int n)
+{
+	return i < 0 ? -i : i >= n ? 2 * n - 2 - i : i;
+}
+
+// original - blurred of row y
+void MosquitoNR::LowpassDiff(float* dstp, int y)
+{
+	if (bits == 32) {
+		const float* p = fluma[0] + (y + 2) * pitch + 8;
+		const float* q = fluma[1] + (y + 2) * pitch + 8;
+		for (int x = 0; x < width; x += 4)
+			_mm_store_ps(dstp + x, _mm_sub_ps(_mm_load_ps(p + x), _mm_load_ps(q + x)));
+	} else {
+		const short* p = luma[0] + (y + 2) * pitch + 8;
+		const short* q = luma[1] + (y + 2) * pitch + 8;
+		for (int x = 0; x < width; x += 8) {
+			const __m128i d = _mm_sub_epi16(_mm_load_si128((const __m128i*)(p + x)), _mm_load_si128((const __m128i*)(q + x)));
+			_mm_store_ps(dstp + x,     _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16)));
+			_mm_store_ps(dstp + x + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(d, d), 16)));
+		}
+	}
+}
+
+static inline void AddRow(float* acc, const float* add, const float* sub, int width)
+{
+	for (int x = 0; x < width; x += 4)
+		_mm_store_ps(acc + x, _mm_sub_ps(_mm_add_ps(_mm_load_ps(acc + x), _mm_load_ps(add + x)), _mm_load_ps(sub + x)));
+}
+
+// original - blurred -> lbuf (vertical)
+template<bool GAUSS>
+void MosquitoNR::LowpassVert(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int r = 1 << (levels - 1);
+	const int ring_size = 2 * r + 2;
+	const int pitch = this->pitch;
+	float* acc  = fwork[thread_id];
+	float* ring = acc + pitch;
+	float* row  = ring + ring_size * pitch;
+	float* tmp  = row + pitch;
+	const float* zero = tmp + pitch;	// never written
+
+	if (!GAUSS) {
+		// box: the sum of 2r+1 rows is moved by one row
+		memset(acc, 0, width * sizeof(float));
+		for (int k = -r; k <= r; ++k) {
+			LowpassDiff(row, reflect(y_start + k, height));
+			AddRow(acc, row, zero, width);
+		}
+		memcpy(lbuf + y_start * pitch, acc, width * sizeof(float));
+
+		for (int y = y_start + 1; y < y_end; ++y) {
+			LowpassDiff(row, reflect(y + r,     height));
+			LowpassDiff(tmp, reflect(y - r - 1, height));
+			AddRow(acc, row, tmp, width);
+			memcpy(lbuf + y * pitch, acc, width * sizeof(float));
+		}
+		return;
+	}
+
+	// gauss: the rows of the first box are kept in the ring for the second one
+	float* box = row;
+
+#define RING(yy) (ring + ((yy) - y_start + ring_size * 2) % ring_size * pitch)
+	memset(box, 0, width * sizeof(float));
+	for (int k = -r; k <= r; ++k) {
+		LowpassDiff(tmp, reflect(y_start - r + k, height));
+		AddRow(box, tmp, zero, width);
+	}
+	memcpy(RING(y_start - r), box, width * sizeof(float));
+	for (int y = y_start - r + 1; y <= y_start + r; ++y) {
+		LowpassDiff(tmp, reflect(y + r, height));
+		AddRow(box, tmp, zero, width);
+		LowpassDiff(tmp, reflect(y - r - 1, height));
+		AddRow(box, zero, tmp, width);
+		memcpy(RING(y), box, width * sizeof(float));
+	}
+
+	memset(acc, 0, width * sizeof(float));
+	for (int k = -r; k <= r; ++k)
+		AddRow(acc, RING(y_start + k), zero, width);
+	memcpy(lbuf + y_start * pitch, acc, width * sizeof(float));
+
+	for (int y = y_start + 1; y < y_end; ++y) {
+		// the first box of row y + r replaces that of row y - r - 2
+		LowpassDiff(tmp, reflect(y + 2 * r, height));
+		AddRow(box, tmp, zero, width);
+		LowpassDiff(tmp, reflect(y - 1, height));
+		AddRow(box, zero, tmp, width);
+		memcpy(RING(y + r), box, width * sizeof(float));
+
+		AddRow(acc, RING(y + r), RING(y - r - 1), width);
+		memcpy(lbuf + y * pitch, acc, width * sizeof(float));
+	}
+#undef RING
+}
+
+// blurred + restore / 128 * horizontal low-pass of lbuf -> luma[1] (fluma[1] for float input)
+template<bool GAUSS>
+void MosquitoNR::LowpassHorz(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int r = 1 << (levels - 1);
+	const int width = this->width;
+	const float norm = GAUSS ? (2 * r + 1.0f) * (2 * r + 1) * (2 * r + 1) * (2 * r + 1) : (2 * r + 1.0f) * (2 * r + 1);
+	const __m128 weight = _mm_set1_ps(restore / (128.0f * norm));
+	const __m128i max12 = _mm_set1_epi16(4095);
+	float* box = fwork[thread_id] + 8;
+	float* row = box + pitch + 8;
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		const float* srcp = lbuf + y * pitch;
+		float s;
+
+		if (!GAUSS) {
+			s = 0;
+			for (int k = -r; k <= r; ++k) s += srcp[reflect(k, width)];
+			row[0] = s;
+			for (int x = 1; x < width; ++x)
+				row[x] = s += srcp[reflect(x + r, width)] - srcp[reflect(x - r - 1, width)];
+		} else {
+			// first box of x = -r .. width+r-1, and the second one
+			s = 0;
+			for (int k = -r; k <= r; ++k) s += srcp[reflect(k - r, width)];
+			box[-r] = s;
+			for (int x = -r + 1; x < width + r; ++x)
+				box[x] = s += srcp[reflect(x + r, width)] - srcp[reflect(x - r - 1, width)];
+			s = 0;
+			for (int k = -r; k <= r; ++k) s += box[k];
+			row[0] = s;
+			for (int x = 1; x < width; ++x)
+				row[x] = s += box[x + r] - box[x - r - 1];
+		}
+
+		if (bits == 32) {
+			float* q = fluma[1] + (y + 2) * pitch + 8;
+			for (int x = 0; x < width; x += 4)
+				_mm_store_ps(q + x, _mm_add_ps(_mm_load_ps(q + x), _mm_mul_ps(_mm_loadu_ps(row + x), weight)));
+		} else {
+			short* q = luma[1] + (y + 2) * pitch + 8;
+			for (int x = 0; x < width; x += 8) {
+				const __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(row + x),     weight));
+				const __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(row + x + 4), weight));
+				__m128i v = _mm_adds_epi16(_mm_load_si128((const __m128i*)(q + x)), _mm_packs_epi32(lo, hi));
+				v = _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()), max12);
+				_mm_store_si128((__m128i*)(q + x), v);
+			}
+		}
+	}
+}
+
+template void MosquitoNR::LowpassVert<false>(int thread_id);
+template void MosquitoNR::LowpassVert<true >(int thread_id);
+template void MosquitoNR::LowpassHorz<false>(int thread_id);
+template void MosquitoNR::LowpassHorz<true >(int thread_id);
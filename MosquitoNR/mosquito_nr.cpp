@@ -19,6 +19,8 @@
 
 // This program is compiled by VC++ 2010 Express.
 
+#include <stdio.h>
+#include <emmintrin.h>
 #include "mosquito_nr.h"
 
 #if !defined(_WIN64)
@@ -40,22 +42,162 @@
 #endif
 
 // constructor
-MosquitoNR::MosquitoNR(PClip _child, int _strength, int _restore, int _radius, int _threads, IScriptEnvironment* env)
-	: GenericVideoFilter(_child), strength(_strength), restore(_restore), radius(_radius), threads(_threads),
-	  width(vi.width), height(vi.height), pitch(((width + 7) &~ 7) + 16)
+MosquitoNR::MosquitoNR(PClip _child, int _strength, int _restore, int _radius, int _threads, int _stream, int _prefetch,
+	int _semiplanar, int _bits, bool _out16, bool _fast, int _wavelet, int _levels, int _lowpass, int _restore1, int _restore2,
+	int _flat, PClip _mask,
+	int _x, int _y, int _w, int _h,
+	int _cache, bool _incremental, const char* _variants,
+	bool _stats, int _output, bool _runtime, IScriptEnvironment* env)
+	: GenericVideoFilter(_child), strength(*_variants ? 32 : _strength), restore(*_variants ? 128 : _restore), radius(_radius),
+	  default_strength(strength), default_restore(restore), default_radius(radius),
+	  restore1(_restore1), restore2(_restore2), threads(_threads),
+	  stream(_stream), prefetch_dist(_prefetch), semiplanar(_semiplanar), bits(_bits), out16(_out16), fast(_fast), wavelet(_wavelet), levels(_levels), lowpass(_lowpass), flat(_flat), mask(_mask), incremental(_incremental), stats(_stats), output(_output), runtime(_runtime),
+	  frame_width(_bits == 32 ? vi.width / 4 : _semiplanar == 2 || _bits > 8 ? vi.width / 2 : vi.width), frame_height(_semiplanar ? vi.height / 3 * 2 : vi.height),
+	  roi_x(_x), roi_y(_y), width(_w > 0 ? _w : frame_width - _x + _w), height(_h > 0 ? _h : frame_height - _y + _h), pitch(((width + 7) &~ 7) + 16),
+	  cache_size(_cache)
 {
 	InitBuffer();
 
 	// error checks
 	if (!(env->GetCPUFlags() & CPUF_SSE2))
 		env->ThrowError("MosquitoNR: SSE2 support is required.");
-	if (!(vi.IsYUY2() || (vi.IsYUV() && vi.IsPlanar() && vi.BytesFromPixels(1) == 1)))
+	if (semiplanar < 0 || semiplanar > 2)
+		env->ThrowError("MosquitoNR: semiplanar must be 0, 1 or 2.");
+	if (semiplanar) {
+		if (!vi.IsY8())
+			env->ThrowError("MosquitoNR: semiplanar input must be carried in a Y8 clip.");
+		if (vi.width % (2 * semiplanar) != 0 || vi.height % 3 != 0)
+			env->ThrowError("MosquitoNR: semiplanar input must have even width and a height of luma * 3 / 2.");
+	}
+	else if (!(vi.IsYUY2() || (vi.IsYUV() && vi.IsPlanar() && vi.BytesFromPixels(1) == 1)))
 		env->ThrowError("MosquitoNR: input must be YUY2 or 8-bit YUV planar format.");
+	if ((bits < 8 || 12 < bits) && bits != 32)
+		env->ThrowError("MosquitoNR: bits must be 8-12 or 32 (luma is processed at 12-bit precision, so use bits=32 for deeper input).");
+	if (bits > 8 && (vi.IsYUY2() || semiplanar == 1 || vi.width % 2 != 0))
+		env->ThrowError("MosquitoNR: bits of more than 8 needs a planar clip of double width or semiplanar=2.");
+	if (bits == 32 && (semiplanar != 0 || vi.width % 4 != 0))
+		env->ThrowError("MosquitoNR: bits=32 needs a planar clip of quadruple width.");
+	if (out16 && (bits != 8 || vi.IsYUY2()))
+		env->ThrowError("MosquitoNR: out16 needs 8-bit planar or NV12 input.");
+	if (fast && (bits != 8 || vi.IsYUY2() || out16 || radius != 1))
+		env->ThrowError("MosquitoNR: fast needs radius=1 and 8-bit planar or NV12 input.");
+	if (wavelet < WAVELET_HAAR || WAVELET_97 < wavelet)
+		env->ThrowError("MosquitoNR: wavelet must be \"haar\", \"5/3\" or \"9/7\".");
+	if (levels < 1 || MAX_LEVELS < levels) env->ThrowError("MosquitoNR: levels must be 1-%d.", MAX_LEVELS);
+	if (lowpass < LOWPASS_NONE || LOWPASS_GAUSS < lowpass)
+		env->ThrowError("MosquitoNR: lowpass must be \"none\", \"box\" or \"gauss\".");
+	if (fast && (wavelet != WAVELET_53 || levels != 2 || lowpass != LOWPASS_NONE || restore1 != 0 || restore2 != 0))
+		env->ThrowError("MosquitoNR: fast needs wavelet=\"5/3\", levels=2, lowpass=\"none\" and restore1/restore2=0.");
+	if (lowpass != LOWPASS_NONE && (restore1 != 0 || restore2 != 0))
+		env->ThrowError("MosquitoNR: restore1/restore2 need lowpass=\"none\".");
+	if (bits == 32 && radius > 2)
+		env->ThrowError("MosquitoNR: bits=32 needs radius of 1 or 2.");
+	if (semiplanar == 2 && bits == 8)
+		env->ThrowError("MosquitoNR: semiplanar=2 needs bits of 9-12.");
+	if (roi_x < 0 || roi_y < 0 || width <= 0 || height <= 0 || roi_x + width > frame_width || roi_y + height > frame_height)
+		env->ThrowError("MosquitoNR: the region is out of the frame.");
+	if (roi_x % 16 != 0 || (width % 16 != 0 && roi_x + width != frame_width))
+		env->ThrowError("MosquitoNR: x must be a multiple of 16, and so must w unless the region reaches the right edge.");
 	if (width < 4 || height < 4) env->ThrowError("MosquitoNR: input is too small.");
+	if (lowpass != LOWPASS_NONE && (width <= 1 << levels || height <= 1 << levels))
+		env->ThrowError("MosquitoNR: input is too small for the low-pass filter of these levels.");
 	if (strength < 0 ||  32 < strength) env->ThrowError("MosquitoNR: strength must be 0-32.");
 	if (restore  < 0 || 128 < restore ) env->ThrowError("MosquitoNR: restore must be 0-128.");
-	if (radius   < 1 ||   2 < radius  ) env->ThrowError("MosquitoNR: radius must be 1 or 2.");
+	if (restore1 < 0 || 128 < restore1) env->ThrowError("MosquitoNR: restore1 must be 0-128.");
+	if (restore2 < 0 || 128 < restore2) env->ThrowError("MosquitoNR: restore2 must be 0-128.");
+	if (radius   < 1 ||   8 < radius  ) env->ThrowError("MosquitoNR: radius must be 1-8.");
+	if (flat     < 0 || 255 < flat    ) env->ThrowError("MosquitoNR: flat must be 0-255.");
+	if (flat > 0 && (radius > 2 || bits == 32 || fast))
+		env->ThrowError("MosquitoNR: flat needs radius of 1 or 2, and integer input without fast.");
+	if (mask) {
+		const VideoInfo& mvi = mask->GetVideoInfo();
+		if (!(mvi.IsYUV() && mvi.IsPlanar() && mvi.BytesFromPixels(1) == 1))
+			env->ThrowError("MosquitoNR: mask must be 8-bit YUV planar format.");
+		if (mvi.width != frame_width || mvi.height != frame_height)
+			env->ThrowError("MosquitoNR: mask must have the same size as luma.");
+		if (radius > 2 || bits == 32 || fast)
+			env->ThrowError("MosquitoNR: mask needs radius of 1 or 2, and integer input without fast.");
+	}
+	if (incremental && (radius > 2 || bits == 32 || fast))
+		env->ThrowError("MosquitoNR: incremental needs radius of 1 or 2, and integer input without fast.");
+	if (stats && (radius > 2 || bits == 32 || fast))
+		env->ThrowError("MosquitoNR: stats needs radius of 1 or 2, and integer input without fast.");
+	if (output < OUTPUT_FILTERED || OUTPUT_BOTH < output)
+		env->ThrowError("MosquitoNR: output must be \"filtered\", \"diff\", \"both\", \"direction\" or \"subbands\".");
+	if (output == OUTPUT_DIRECTION && (radius > 2 || bits != 8 || vi.IsYUY2() || semiplanar || out16 || fast || width != frame_width || height != frame_height))
+		env->ThrowError("MosquitoNR: output=\"direction\" needs radius of 1 or 2, and 8-bit planar input without out16, fast, x, y, w and h.");
+	if (output == OUTPUT_SUBBANDS && (bits != 8 || vi.IsYUY2() || semiplanar || out16 || fast || mask || width != frame_width || height != frame_height ||
+		wavelet != WAVELET_53 || levels != 2 || lowpass != LOWPASS_NONE || restore1 != 0 || restore2 != 0))
+		env->ThrowError("MosquitoNR: output=\"subbands\" needs 8-bit planar input restored by the asm CDF 5/3 (wavelet=\"5/3\" and levels=2 without lowpass, restore1 and restore2), without out16, fast, mask, x, y, w and h.");
+	if ((output == OUTPUT_DIFF || output == OUTPUT_BOTH) && (bits == 32 || vi.IsYUY2() || fast || width != frame_width || height != frame_height))
+		env->ThrowError("MosquitoNR: output=\"diff\" and \"both\" need integer planar or semiplanar input without fast, x, y, w and h.");
+	if (output == OUTPUT_BOTH && semiplanar)
+		env->ThrowError("MosquitoNR: output=\"both\" is not for semiplanar input.");
+	// the correction, the direction and SAD maps or the subbands are stacked below the filtered frame
+	stack = output == OUTPUT_BOTH || output == OUTPUT_SUBBANDS ? 2 : output == OUTPUT_DIRECTION ? 3 : 1;
+	vi.height *= stack;
+	skip_blocks = flat > 0 || mask || incremental;
+
+	// "strength/restore,strength/restore,..." (the analysis runs with strength=32 and restore=128)
+	variants = 0;
+	for (const char* p = _variants; *p; ) {
+		int s, r, len;
+		if (variants == MAX_VARIANTS || sscanf(p, " %d / %d %n", &s, &r, &len) != 2)
+			env->ThrowError("MosquitoNR: variants must be up to %d of \"strength/restore\" separated by commas.", MAX_VARIANTS);
+		if (s < 0 || 32 < s || r < 0 || 128 < r)
+			env->ThrowError("MosquitoNR: strength of variants must be 0-32, and restore 0-128.");
+		variant_strength[variants] = s, variant_restore[variants] = r, ++variants;
+		p += len;
+		if (*p == ',') ++p;
+	}
+	if (variants) {
+		if (fast || bits == 32 || mask || cache_size > 0 || restore1 != 0 || restore2 != 0 || output != OUTPUT_FILTERED || runtime)
+			env->ThrowError("MosquitoNR: variants needs integer input without fast, mask, cache, restore1, restore2, output and runtime.");
+		vi.num_frames *= variants;
+		vi.MulDivFPS(variants, 1);
+	}
+	variant = 0, variant_frame = -1;
+	if (radius > 2 && (width < 16 || height < 16)) env->ThrowError("MosquitoNR: input is too small for radius of 3 or more.");
+
+	// radius can be changed per frame within what the options allow (the buffers are allocated for it)
+	max_radius = !runtime ? radius : fast ? 1
+	           : bits == 32 || flat > 0 || mask || incremental || stats || output == OUTPUT_DIRECTION || width < 16 || height < 16 ? 2 : 8;
+	if (cache_size < 0 || MAX_CACHE < cache_size) env->ThrowError("MosquitoNR: cache must be 0-%d.", MAX_CACHE);
 	if (threads  < 0 || MAX_THREADS < threads ) env->ThrowError("MosquitoNR: threads must be 0(auto) or 1-%d.", MAX_THREADS);
+	if (stream   < -1 || 1 < stream) env->ThrowError("MosquitoNR: stream must be -1(auto), 0 or 1.");
+	if (prefetch_dist != -1 && (prefetch_dist < 0 || 4096 < prefetch_dist || prefetch_dist % 64 != 0))
+		env->ThrowError("MosquitoNR: prefetch must be -1(auto) or a multiple of 64 in 0-4096.");
+
+	// conversion between 16-bit samples and the internal 12-bit precision
+	// (P010/P012 samples are MSB aligned, the others are LSB aligned)
+	if (bits <= 12) {
+		const int msb = semiplanar == 2 ? 16 : bits;
+		in_shift_r  = max(msb - 12, 0);
+		in_shift_l  = max(12 - msb, 0);
+		in_round    = in_shift_r ? 1 << (in_shift_r - 1) : 0;
+		out_shift_r = 12 - bits;
+		out_shift_l = msb - bits;
+		out_round   = out_shift_r ? 1 << (out_shift_r - 1) : 0;
+		out_max     = (1 << bits) - 1;
+	}
+
+	// the SADs of 8-bit input are multiples of 8 (the half-pixel averages of the samples scaled by 16),
+	// and each bit more needs one more shift to keep the lower 3 bits for the direction
+	sad_shift = bits <= 12 ? min(max(bits - 8, 0), 3) : 0;
+
+	// internal 12-bit precision is output as is (scaled to 16 bits)
+	if (out16) {
+		out_round = out_shift_r = 0;
+		out_max     = 4095;
+		out_shift_l = 4;
+		vi.width   *= 2;
+	}
+
+	in_bytes  = bits == 32 ? 4 : vi.IsYUY2() || semiplanar == 2 || bits > 8 ? 2 : 1;
+	out_bytes = out16 ? 2 : in_bytes;
+
+	// the filtered frame keeps chroma and the luma outside the region of the source
+	in_place = output == OUTPUT_FILTERED && !out16;
 
 	// detect the number of processors
 	if (threads == 0) {
@@ -64,13 +206,29 @@ MosquitoNR::MosquitoNR(PClip _child, int _strength, int _restore, int _radius, i
 		threads = min(si.dwNumberOfProcessors, MAX_THREADS);
 	}
 
+	// the asm 5/3 kernels restore only the approximation of level 2
+	// (restore may become nonzero later with runtime)
+	use_lifting = lowpass == LOWPASS_NONE &&
+		(restore1 != 0 || restore2 != 0 || ((restore != 0 || runtime) && (wavelet != WAVELET_53 || levels != 2)));
+
 	// allocate buffer and create threads
 	if (!AllocBuffer())
 		env->ThrowError("MosquitoNR: failed to allocate buffer.");
 	if (!mt.CreateThreads(threads, this))
 		env->ThrowError("MosquitoNR: failed to create threads.");
 
+	// with runtime, the strength of the first frames is not known yet
+	fast_checked  = strength == 0 && !runtime ? TUNE_ROUNDS : 0;
+	max_deviation = 0;
+	total_blocks   = ((width + 7) / 8) * ((height + 7) / 8);
+	prev_valid     = false;
+	cache_clock    = 0;
+	cache_hits     = cache_requests = 0;
+	for (int i = 0; i < MAX_CACHE; ++i) cache[i].last_used = 0;
+
 	CPUCheck();
+	InitTuning();
+	SelectPipeline();
 }
 
 // destructor
@@ -79,58 +237,724 @@ MosquitoNR::~MosquitoNR() {	FreeBuffer(); }
 // filter process
 PVideoFrame __stdcall MosquitoNR::GetFrame(int n, IScriptEnvironment* env)
 {
+	if (variants) variant = n % variants, n /= variants;
+	source_frame = n;
+	if (runtime) UpdateParams(env);
 	src = child->GetFrame(n, env);
-	dst = env->NewVideoFrame(vi);
 
-	// copy chroma
-	if (!vi.IsY8() && vi.IsPlanar()) {
-		env->BitBlt(dst->GetWritePtr(PLANAR_U), dst->GetPitch(PLANAR_U), src->GetReadPtr(PLANAR_U), src->GetPitch(PLANAR_U),
-			vi.GetRowSize(PLANAR_U), vi.GetHeight(PLANAR_U));
-		env->BitBlt(dst->GetWritePtr(PLANAR_V), dst->GetPitch(PLANAR_V), src->GetReadPtr(PLANAR_V), src->GetPitch(PLANAR_V),
-			vi.GetRowSize(PLANAR_V), vi.GetHeight(PLANAR_V));
+	// nothing to change
+	if (process == &MosquitoNR::ProcessCopy && !out16) return ReturnFrame(src);
+
+	if (mask) mask_frame = mask->GetFrame(n, env);
+
+	// the luma is written over the source frame when no one else holds it (AviSynth frames cannot
+	// share planes), otherwise chroma is copied by the threads while this thread reads the luma
+	// (the outputs other than the filtered frame have neutral chroma)
+	// the output kernels store 16 bytes aligned, up to 15 bytes past the end of the region rows, so
+	// the source frame also needs an aligned luma plane and the padding (NewVideoFrame has both)
+	const int row_end = roi_x * out_bytes + ((width * out_bytes + 15) &~ 15);
+	const bool overwrite = in_place && !(fast && fast_checked < TUNE_ROUNDS) && src->IsWritable() &&
+		(((UINT_PTR)src->GetReadPtr() | src->GetPitch()) & 15) == 0 && src->GetPitch() >= row_end;
+	if (overwrite) {
+		dst = src;
+		src = NULL;
+	} else {
+		dst = env->NewVideoFrame(vi);
+		if (output == OUTPUT_FILTERED || stack > 1) StartChromaCopy();
+		if (output != OUTPUT_FILTERED) NeutralChroma();
+
+		// luma outside the region is passed through
+		if (process != &MosquitoNR::ProcessCopy && (width != frame_width || height != frame_height))
+			CopyOutsideRegion(env);
+	}
+
+	// duplicate of a cached source
+	unsigned __int64 hash[2];
+	if (cache_size > 0) {
+		HashSource(hash);
+		if (CacheLookup(hash, env)) return ReturnFrame(dst);
+	}
+
+	if (process == &MosquitoNR::ProcessCopy) {
+		(this->*process)(env);		// strength=0 (with runtime) is neither checked nor measured
+	} else if (fast && fast_checked < TUNE_ROUNDS) {
+		CheckDeviation(env);
+	} else if (tune_count < tune_settings * TUNE_ROUNDS) {
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		(this->*process)(env);
+		QueryPerformanceCounter(&end);
+		Tune(end.QuadPart - start.QuadPart);
+	} else {
+		(this->*process)(env);
+	}
+
+	if (cache_size > 0) CacheStore(hash);
+	return ReturnFrame(dst);
+}
+
+// the chroma copy is finished, and the frames are not held by the filter
+// (the next filter can write to the output frame without copying it)
+PVideoFrame MosquitoNR::ReturnFrame(PVideoFrame frame)
+{
+	mt.WaitMTFunc();
+	src = NULL;
+	dst = NULL;
+	mask_frame = NULL;
+	return frame;
+}
+
+// choose the specialized kernels and pipeline for the parameters
+void MosquitoNR::SelectPipeline()
+{
+	if (radius == 1) {
+		coef[0] =  64 - strength * 2;	// own pixel's coefficient (when divisor = 64)
+		coef[1] = 128 - strength * 4;	// own pixel's coefficient (when divisor = 128)
+		coef[2] = strength;				// other pixel's coefficient
+		coef[3] = 0;
+		smoothing = ssse3 ? &MosquitoNR::SmoothingSSSE3<1> : &MosquitoNR::SmoothingSSE2<1>;
+	} else if (radius == 2) {
+		coef[0] = 128 - strength * 4;	// own pixel's coefficient (when divisor = 128)
+		coef[1] = 256 - strength * 8;	// own pixel's coefficient (when divisor = 256)
+		coef[2] = strength;				// other pixel's coefficient
+		coef[3] = strength * 2;			// other pixel's coefficient (doubled)
+		smoothing = ssse3 ? &MosquitoNR::SmoothingSSSE3<2> : &MosquitoNR::SmoothingSSE2<2>;
+	} else {
+		// weights are computed in the kernel from radius
+		coef[0] = coef[1] = coef[2] = coef[3] = 0;
+		smoothing = &MosquitoNR::SmoothingWide;
+	}
+
+	multiplier = ((128 - restore) << 16) + restore;
+
+#define PIPELINES(input) { \
+		{ &MosquitoNR::Process<input, RESTORE_NONE, false>, &MosquitoNR::Process<input, RESTORE_FULL, false>, \
+		  &MosquitoNR::Process<input, RESTORE_BLEND, false>, &MosquitoNR::Process<input, RESTORE_LIFTING, false>, \
+		  &MosquitoNR::Process<input, RESTORE_LOWPASS, false> }, \
+		{ &MosquitoNR::Process<input, RESTORE_NONE, true >, &MosquitoNR::Process<input, RESTORE_FULL, true >, \
+		  &MosquitoNR::Process<input, RESTORE_BLEND, true >, &MosquitoNR::Process<input, RESTORE_LIFTING, true >, \
+		  &MosquitoNR::Process<input, RESTORE_LOWPASS, true > }, \
+	}
+	static const PipelineFunc pipelines[4][2][5] = {
+		PIPELINES(INPUT_PLANAR8), PIPELINES(INPUT_YUY2), PIPELINES(INPUT_PLANAR16), PIPELINES(INPUT_PLANAR8_OUT16),
+	};
+#undef PIPELINES
+	// (the subbands are taken from the wavelet, so it runs at restore=0 and blends none of the original in)
+	const int mode  = restore == 0 && restore1 == 0 && restore2 == 0 && output != OUTPUT_SUBBANDS ? RESTORE_NONE : use_lifting ? RESTORE_LIFTING
+	                : lowpass != LOWPASS_NONE ? RESTORE_LOWPASS : restore == 128 ? RESTORE_FULL : RESTORE_BLEND;
+	const int input = vi.IsYUY2() ? INPUT_YUY2 : semiplanar == 2 || bits > 8 ? INPUT_PLANAR16
+	                : out16 ? INPUT_PLANAR8_OUT16 : INPUT_PLANAR8;
+
+	if (bits == 32)
+		smoothing = radius == 1 ? &MosquitoNR::SmoothingFloat<1> : &MosquitoNR::SmoothingFloat<2>;
+	if (fast)
+		smoothing = &MosquitoNR::SmoothingFast;
+
+#define LIFTING_STAGES(wavelet) { \
+		&MosquitoNR::LiftForwardHorz<wavelet>, &MosquitoNR::LiftForwardVert<wavelet>, \
+		&MosquitoNR::LiftInverseVert<wavelet>, &MosquitoNR::LiftInverseHorz<wavelet>, \
+	}
+	static const MTFunc lifting_stages[3][4] = {
+		LIFTING_STAGES(WAVELET_HAAR), LIFTING_STAGES(WAVELET_53), LIFTING_STAGES(WAVELET_97),
+	};
+#undef LIFTING_STAGES
+	lifting = lifting_stages[wavelet];
+
+	static const MTFunc lowpass_box[2]   = { &MosquitoNR::LowpassVert<false>, &MosquitoNR::LowpassHorz<false> };
+	static const MTFunc lowpass_gauss[2] = { &MosquitoNR::LowpassVert<true >, &MosquitoNR::LowpassHorz<true > };
+	lowpass_stages = lowpass == LOWPASS_GAUSS ? lowpass_gauss : lowpass_box;
+
+	precise = pipelines[input][nt_store][mode];
+
+	if      (strength == 0 && output == OUTPUT_FILTERED) process = &MosquitoNR::ProcessCopy;
+	else if (bits == 32   ) process = &MosquitoNR::ProcessFloat;
+	else if (fast         ) process = &MosquitoNR::ProcessFast;
+	else                    process = precise;
+	if (variants)           process = &MosquitoNR::ProcessVariants;
+}
+
+// value of an int global variable, or def if it is not defined
+static int GetIntVar(IScriptEnvironment* env, const char* name, int def)
+{
+	try {
+		const AVSValue v = env->GetVar(name);
+		return v.IsInt() ? v.AsInt() : def;
+	} catch (IScriptEnvironment::NotFound) {
+		return def;
+	}
+}
+
+// strength/restore/radius of the current frame from global variables (the values given to the filter
+// when they are not defined), so one instance with its buffers and threads serves per-scene settings
+void MosquitoNR::UpdateParams(IScriptEnvironment* env)
+{
+	const int s = GetIntVar(env, "MosquitoNR_strength", default_strength);
+	const int r = GetIntVar(env, "MosquitoNR_restore",  default_restore);
+	const int d = GetIntVar(env, "MosquitoNR_radius",   default_radius);
+	if (s < 0 ||  32 < s) env->ThrowError("MosquitoNR: MosquitoNR_strength must be 0-32.");
+	if (r < 0 || 128 < r) env->ThrowError("MosquitoNR: MosquitoNR_restore must be 0-128.");
+	if (d < 1 || max_radius < d) env->ThrowError("MosquitoNR: MosquitoNR_radius must be 1-%d with these options.", max_radius);
+	if (s == strength && r == restore && d == radius) return;
+
+	// the blur and the output kept by incremental are of the previous parameters
+	prev_valid = false;
+	strength = s, restore = r, radius = d;
+
+	// the times measured so far are of the previous parameters
+	if (tune_count < tune_settings * TUNE_ROUNDS) InitTuning();
+	SelectPipeline();
+}
+
+// list the store/prefetch settings to be benchmarked on the first frames
+void MosquitoNR::InitTuning()
+{
+	static const int distances[] = { 0, 256, 512, 1024 };
+
+	tune_settings = tune_count = 0;
+
+	for (int nt = 0; nt < 2; ++nt) {
+		if (stream != -1 && stream != nt) continue;
+		for (int i = 0; i < 4; ++i) {
+			if (prefetch_dist != -1 && prefetch_dist != distances[i]) continue;
+			tune[tune_settings].nt_store = nt != 0;
+			tune[tune_settings].prefetch = distances[i];
+			tune[tune_settings].time     = -1;
+			++tune_settings;
+		}
+	}
+
+	// both settings are given explicitly
+	if (tune_settings == 0) {
+		tune[0].nt_store = stream != 0;
+		tune[0].prefetch = prefetch_dist;
+		tune_settings = 1;
+	}
+
+	nt_store = tune[0].nt_store;
+	prefetch = tune[0].prefetch;
+
+	// nothing to compare or nothing to do (the float pipeline has no such settings)
+	// (with runtime, strength=0 of the first frames is not measured but may change later)
+	if (tune_settings == 1 || (strength == 0 && !runtime) || bits == 32 || fast || variants) tune_count = tune_settings * TUNE_ROUNDS;
+}
+
+// record the time of the current setting and move to the next one
+// (settings are measured round robin, and the fastest run of each is kept)
+void MosquitoNR::Tune(__int64 time)
+{
+	TuneInfo& t = tune[tune_count % tune_settings];
+	if (t.time < 0 || time < t.time) t.time = time;
+
+	if (++tune_count < tune_settings * TUNE_ROUNDS) {
+		nt_store = tune[tune_count % tune_settings].nt_store;
+		prefetch = tune[tune_count % tune_settings].prefetch;
+	} else {
+		int best = 0;
+		for (int i = 1; i < tune_settings; ++i)
+			if (tune[i].time < tune[best].time) best = i;
+		nt_store = tune[best].nt_store;
+		prefetch = tune[best].prefetch;
 	}
 
-	if (strength == 0) {	// do nothing
-		env->BitBlt(dst->GetWritePtr(), dst->GetPitch(), src->GetReadPtr(), src->GetPitch(), vi.GetRowSize(), vi.GetHeight());
-		return dst;
+	SelectPipeline();
+}
+
+// do nothing (luma of the whole frame is widened to 16 bits, the source frame is returned otherwise)
+void MosquitoNR::ProcessCopy(IScriptEnvironment* env)
+{
+	CopyLumaRect(env, 0, 0, frame_width, frame_height);
+}
+
+// luma outside the region: the bands above and below it, and the strips on its left and right
+void MosquitoNR::CopyOutsideRegion(IScriptEnvironment* env)
+{
+	const int right = roi_x + width, bottom = roi_y + height;
+	CopyLumaRect(env, 0,     0,      frame_width,         roi_y);
+	CopyLumaRect(env, 0,     bottom, frame_width,         frame_height - bottom);
+	CopyLumaRect(env, 0,     roi_y,  roi_x,               height);
+	CopyLumaRect(env, right, roi_y,  frame_width - right, height);
+}
+
+// rectangle of luma of the source -> output frame (widened to 16 bits for out16)
+void MosquitoNR::CopyLumaRect(IScriptEnvironment* env, int x, int y, int w, int h)
+{
+	if (w <= 0 || h <= 0) return;
+	const BYTE* srcp = src->GetReadPtr()  + y * src->GetPitch() + x * in_bytes;
+	BYTE* dstp       = dst->GetWritePtr() + y * dst->GetPitch() + x * out_bytes;
+
+	if (out16) WidenPlane(dstp, dst->GetPitch(), srcp, src->GetPitch(), w, h);
+	else       env->BitBlt(dstp, dst->GetPitch(), srcp, src->GetPitch(), w * in_bytes, h);
+}
+
+// source frame (the output frame when the luma is written over it)
+const PVideoFrame& MosquitoNR::SrcFrame() const
+{
+	return src ? src : dst;
+}
+
+// top-left of the region in the luma of the input frame
+const BYTE* MosquitoNR::SrcLuma() const
+{
+	const PVideoFrame& f = SrcFrame();
+	return f->GetReadPtr() + roi_y * f->GetPitch() + roi_x * in_bytes;
+}
+
+// top-left of the region in the luma of the output frame
+BYTE* MosquitoNR::DstLuma() const
+{
+	return dst->GetWritePtr() + roi_y * dst->GetPitch() + roi_x * out_bytes;
+}
+
+// approximation coefficients of the original in the asm restore stages
+// (they overwrite the original, unless it is kept)
+short* MosquitoNR::OrigApprox() const
+{
+	return bufa ? bufa : luma[0];
+}
+
+// 8-bit samples -> 16-bit samples (v << 8)
+void MosquitoNR::WidenPlane(BYTE* dstp, int dst_pitch, const BYTE* srcp, int src_pitch, int row_size, int height)
+{
+	const int hloop = row_size / 16;
+
+	for (int y = 0; y < height; ++y, srcp += src_pitch, dstp += dst_pitch)
+	{
+		const BYTE* s = srcp;
+		BYTE* d = dstp;
+
+		if (hloop > 0) {
+			__asm
+			{
+				mov			rsi, s
+				mov			rdi, d
+				mov			ecx, hloop
+				pxor		xmm7, xmm7
+
+align 16
+next16pixels_widen:
+				movdqu		xmm0, [rsi]
+				movdqa		xmm1, xmm7
+				movdqa		xmm2, xmm7
+				punpcklbw	xmm1, xmm0
+				punpckhbw	xmm2, xmm0
+				movdqu		[rdi], xmm1
+				movdqu		[rdi+16], xmm2
+				add			rsi, 16
+				add			rdi, 32
+				sub			ecx, 1
+				jnz			next16pixels_widen
+			}
+		}
+
+		for (int x = hloop * 16; x < row_size; ++x)
+			reinterpret_cast<unsigned short*>(dstp)[x] = srcp[x] << 8;
+	}
+}
+
+template<int INPUT, int RESTORE, bool STREAM>
+void MosquitoNR::Process(IScriptEnvironment* env)
+{
+	// the source of the previous frame is kept for the comparison
+	if (incremental) {
+		short* p = luma[0];
+		luma[0] = prev_luma, prev_luma = p;
+		BYTE* b = block_flags;
+		block_flags = prev_flags, prev_flags = b;
+	}
+
+	if      (INPUT == INPUT_YUY2    ) mt.ExecMTFunc(&MosquitoNR::UnpackYUY2);
+	else if (INPUT == INPUT_PLANAR16) CopyLumaFrom16();
+	else                              CopyLumaFrom();
+	if (stats) memset(changed_map, 0, total_blocks);
+	mt.ExecMTFunc(smoothing);
+	const bool all_skipped = skip_blocks && CountSkippedBlocks() == total_blocks;
+	if (stats) MeasureStats();
+	PublishStats(env, frame_stats);
+	prev_valid = incremental;
+	if (variants) mt.ExecMTFunc(&MosquitoNR::SaveBlur);
+
+	// only the asm stages skip strips (the others read further), and the subbands read all coefficients
+	if (strip_action) PlanStrips((RESTORE == RESTORE_FULL || RESTORE == RESTORE_BLEND) && output != OUTPUT_SUBBANDS);
+
+	if (RESTORE == RESTORE_NONE || (all_skipped && output != OUTPUT_SUBBANDS))
+	{
+		// luma[1] is a copy of luma[0] when all blocks are skipped, so there is nothing to restore
+	}
+	else if (RESTORE == RESTORE_LIFTING)
+	{
+		RestoreLifting();
+	}
+	else if (RESTORE == RESTORE_LOWPASS)
+	{
+		mt.ExecMTFunc(lowpass_stages[0]);
+		mt.ExecMTFunc(lowpass_stages[1]);
+	}
+	else
+	{
+		mt.ExecMTFunc(&MosquitoNR::WaveletVert1);
+		mt.ExecMTFunc(&MosquitoNR::WaveletHorz1);
+		mt.ExecMTFunc(&MosquitoNR::WaveletVert2<STREAM>);
+
+		if (RESTORE == RESTORE_FULL) {
+			mt.ExecMTFunc(&MosquitoNR::WaveletHorz2);
+		} else {
+			mt.ExecMTFunc(&MosquitoNR::WaveletHorz3);
+			mt.ExecMTFunc(&MosquitoNR::BlendCoef);
+		}
+
+		mt.ExecMTFunc(&MosquitoNR::InvWaveletHorz);
+		mt.ExecMTFunc(&MosquitoNR::InvWaveletVert);
+	}
+
+	// restoring spreads the change beyond the mask
+	if (mask && !all_skipped) mt.ExecMTFunc(&MosquitoNR::BlendMask);
+
+	// output of the variants is synthesized from the analysis (see ProcessVariants)
+	if (variants) return;
+
+	// the correction replaces the filtered luma
+	if (output == OUTPUT_DIFF) {
+		mt.ExecMTFunc(&MosquitoNR::CopyDiff<STREAM>);
+		return;
+	}
+
+	if      (INPUT == INPUT_YUY2    ) mt.ExecMTFunc(&MosquitoNR::PackYUY2<STREAM>);
+	else if (INPUT == INPUT_PLANAR16 || INPUT == INPUT_PLANAR8_OUT16) CopyLumaTo16<STREAM>();
+	else                              CopyLumaTo<STREAM>();
+
+	// the correction or the direction field below the filtered frame
+	if (output == OUTPUT_BOTH     ) mt.ExecMTFunc(&MosquitoNR::CopyDiff<STREAM>);
+	if (output == OUTPUT_DIRECTION) CopyDirection(env);
+	if (output == OUTPUT_SUBBANDS ) mt.ExecMTFunc(&MosquitoNR::Subbands);
+}
+
+// several strength/restore settings from one analysis (see variants.cpp):
+// each source frame is analyzed with strength=32 and restore=128 once, then each variant is synthesized
+void MosquitoNR::ProcessVariants(IScriptEnvironment* env)
+{
+	if (variant_frame != source_frame) {
+		(this->*precise)(env);
+		short* p = luma[1];
+		luma[1] = var_restore, var_restore = p;
+		variant_frame = source_frame;
 	}
 
-	CopyLumaFrom();
-	mt.ExecMTFunc(&MosquitoNR::Smoothing);
+	mt.ExecMTFunc(&MosquitoNR::SynthesizeVariant);
 
-	if (restore == 0) {		// no restoring
-		CopyLumaTo();
-		return dst;
+	if (vi.IsYUY2()) {
+		mt.ExecMTFunc(nt_store ? &MosquitoNR::PackYUY2<true> : &MosquitoNR::PackYUY2<false>);
+	} else if (semiplanar == 2 || bits > 8 || out16) {
+		if (nt_store) CopyLumaTo16<true>();
+		else          CopyLumaTo16<false>();
+	} else {
+		if (nt_store) CopyLumaTo<true>();
+		else          CopyLumaTo<false>();
 	}
+}
 
-	mt.ExecMTFunc(&MosquitoNR::WaveletVert1);
-	mt.ExecMTFunc(&MosquitoNR::WaveletHorz1);
-	mt.ExecMTFunc(&MosquitoNR::WaveletVert2);
+// float input: the difference between the original and the blurred image is decomposed,
+// and the interpolation of its level-2 approximation is added to the blurred image
+// (same as replacing the approximation coefficients, since there is no rounding)
+void MosquitoNR::ProcessFloat(IScriptEnvironment* env)
+{
+	CopyLumaFromFloat();
+	mt.ExecMTFunc(smoothing);
 
-	if (restore == 128) {
-		mt.ExecMTFunc(&MosquitoNR::WaveletHorz2);
+	if (restore == 0 && restore1 == 0 && restore2 == 0) {
+		CopyLumaToFloat();
+	} else if (use_lifting) {
+		RestoreLifting();
+		CopyLumaToFloat();
+	} else if (lowpass != LOWPASS_NONE) {
+		mt.ExecMTFunc(lowpass_stages[0]);
+		mt.ExecMTFunc(lowpass_stages[1]);
+		CopyLumaToFloat();
 	} else {
-		mt.ExecMTFunc(&MosquitoNR::WaveletHorz3);
-		mt.ExecMTFunc(&MosquitoNR::BlendCoef);
+		mt.ExecMTFunc(&MosquitoNR::WaveletFloat<1>);
+		mt.ExecMTFunc(&MosquitoNR::WaveletFloat<2>);
+		mt.ExecMTFunc(&MosquitoNR::InvWaveletFloat<2>);
+		mt.ExecMTFunc(&MosquitoNR::InvWaveletFloat<1>);
+	}
+}
+
+// restoring by the lifting engine (see wavelet_lifting.cpp): the difference between the original
+// and the blurred image is decomposed level by level (each level from the approximation of the previous one),
+// and the inverse transform of its weighted subbands is added to luma[1] (fluma[1] for float input)
+void MosquitoNR::RestoreLifting()
+{
+	for (lift_level = 1; lift_level <= levels; ++lift_level) {
+		mt.ExecMTFunc(lifting[0]);
+		mt.ExecMTFunc(lifting[1]);
+	}
+	for (lift_level = levels; lift_level >= 1; --lift_level) {
+		mt.ExecMTFunc(lifting[2]);
+		mt.ExecMTFunc(lifting[3]);
+	}
+}
+
+// sum the blocks skipped by the smoothing threads: copied from the source (returned) and
+// copied from the previous frame
+int MosquitoNR::CountSkippedBlocks()
+{
+	int count = 0, reused = 0;
+	for (int i = 0; i < threads; ++i) count += skip_count[i], reused += reuse_count[i];
+	frame_stats.skipped = count;
+	frame_stats.reused  = reused;
+	return count;
+}
+
+// what the asm restore stages run on each 8-row strip: the output rows 8g..8g+7 read the rows 8g-2..8g+10
+// (so the block rows g-1..g+1), and when these are all copied from the source, restoring gives the source
+// back, which luma[1] already holds (the blend of restore is exact on equal coefficients); when they all reuse
+// the previous blur, everything restoring reads is the same as the previous frame, which restored the strip
+// with the same parameters (it blurred these blocks), so its output in prev_restored is copied
+// skip is false when every strip is run
+void MosquitoNR::PlanStrips(bool skip)
+{
+	const int blocks = (width + 7) / 8;
+	const int strips = (height + 7) / 8;
+
+	// STRIP_KEEP or STRIP_REUSE when all blocks of the block row have that flag
+	for (int by = 0; by < strips; ++by) {
+		int all = skip ? STRIP_KEEP | STRIP_REUSE : STRIP_RUN;
+		for (int bx = 0; bx < blocks && all; ++bx) all &= block_flags[by * blocks + bx];
+		strip_action[by] = all;
+	}
+
+	// the rows reflected outside the frame are read from the first and last block rows
+	for (int g = 0, above = STRIP_KEEP | STRIP_REUSE; g < strips; ++g) {
+		const int here = strip_action[g], below = g + 1 < strips ? strip_action[g + 1] : STRIP_KEEP | STRIP_REUSE;
+		strip_action[g] = above & here & below;
+		above = here;
+	}
+
+	// the coefficients read by the strips that are run: InvWaveletVert of strip g reads the vertical details
+	// of the strips g-1..g+1 and InvWaveletHorz of the 16-row strips (g-1)/2..(g+1)/2, which read the strips
+	// of their own rows
+	for (int g = 0; g < strips; ++g) {
+		strip_forward[g] = 0;
+		for (int i = max(g - 2, 0); i <= min(g + 2, strips - 1); ++i) strip_forward[g] |= strip_action[i] == STRIP_RUN;
+	}
+	for (int h = 0; h < (strips + 1) / 2; ++h) {
+		strip_horz[h] = 0;
+		for (int i = max(2 * h - 1, 0); i <= min(2 * h + 1, strips - 1); ++i) strip_horz[h] |= strip_action[i] == STRIP_RUN;
+	}
+}
+
+// direction_map (the directions, then the SADs) -> luma below the filtered frame
+void MosquitoNR::CopyDirection(IScriptEnvironment* env)
+{
+	env->BitBlt(DstLuma() + frame_height * dst->GetPitch(), dst->GetPitch(), direction_map, direction_pitch, width, 2 * height);
+}
+
+// rows of 8/16-bit samples = v
+static void FillRows(BYTE* p, int pitch, int row_size, int rows, int bytes, int v)
+{
+	for (int y = 0; y < rows; ++y, p += pitch) {
+		if (bytes == 1) memset(p, v, row_size);
+		else for (int x = 0; x < row_size / 2; ++x) reinterpret_cast<unsigned short*>(p)[x] = v;
+	}
+}
+
+// chroma planes of the source -> output frame, on the threads without waiting (see ReturnFrame)
+void MosquitoNR::StartChromaCopy()
+{
+	const VideoInfo& svi = child->GetVideoInfo();
+	chroma_planes = 0;
+
+	if (semiplanar) {
+		PlaneCopy& c = chroma_copy[chroma_planes++];
+		c.srcp      = src->GetReadPtr()  + frame_height * src->GetPitch();
+		c.dstp      = dst->GetWritePtr() + frame_height * dst->GetPitch();
+		c.src_pitch = src->GetPitch();
+		c.dst_pitch = dst->GetPitch();
+		c.row_size  = svi.GetRowSize();
+		c.rows      = svi.height - frame_height;
+	} else if (!vi.IsY8() && vi.IsPlanar()) {
+		const int planes[2] = { PLANAR_U, PLANAR_V };
+		for (int i = 0; i < 2; ++i) {
+			PlaneCopy& c = chroma_copy[chroma_planes++];
+			c.srcp      = src->GetReadPtr(planes[i]);
+			c.dstp      = dst->GetWritePtr(planes[i]);
+			c.src_pitch = src->GetPitch(planes[i]);
+			c.dst_pitch = dst->GetPitch(planes[i]);
+			c.row_size  = svi.GetRowSize(planes[i]);
+			c.rows      = svi.GetHeight(planes[i]);
+		}
+	}
+
+	if (chroma_planes) mt.StartMTFunc(&MosquitoNR::CopyChroma);
+}
+
+// rows of the chroma planes of each thread (widened to 16 bits for out16)
+void MosquitoNR::CopyChroma(int thread_id)
+{
+	for (int i = 0; i < chroma_planes; ++i)
+	{
+		const PlaneCopy& c = chroma_copy[i];
+		const int y_start = c.rows *  thread_id      / threads;
+		const int y_end   = c.rows * (thread_id + 1) / threads;
+		const BYTE* srcp = c.srcp + y_start * c.src_pitch;
+		BYTE* dstp = c.dstp + y_start * c.dst_pitch;
+
+		if (out16) {
+			WidenPlane(dstp, c.dst_pitch, srcp, c.src_pitch, c.row_size, y_end - y_start);
+		} else {
+			for (int y = y_start; y < y_end; ++y, srcp += c.src_pitch, dstp += c.dst_pitch)
+				memcpy(dstp, srcp, c.row_size);
+		}
+	}
+}
+
+// chroma of the outputs other than the filtered frame = middle of the range
+// (only below the filtered frame for "both" and "direction")
+void MosquitoNR::NeutralChroma()
+{
+	const VideoInfo& svi = child->GetVideoInfo();
+	const int mid = out_bytes == 1 ? 128 : ((2048 + out_round) >> out_shift_r) << out_shift_l;
+
+	if (semiplanar) {
+		FillRows(dst->GetWritePtr() + frame_height * dst->GetPitch(), dst->GetPitch(), vi.GetRowSize(), vi.height - frame_height, out_bytes, mid);
+	} else if (!vi.IsY8()) {
+		const int planes[2] = { PLANAR_U, PLANAR_V };
+		for (int i = 0; i < 2; ++i) {
+			const int y_start = stack > 1 ? svi.GetHeight(planes[i]) : 0;
+			FillRows(dst->GetWritePtr(planes[i]) + y_start * dst->GetPitch(planes[i]), dst->GetPitch(planes[i]),
+				vi.GetRowSize(planes[i]), vi.GetHeight(planes[i]) - y_start, out_bytes, mid);
+		}
+	}
+}
+
+// statistics of the blur of the current frame (in 8-bit units)
+//   detail_energy   : mean square of the level-1 detail coefficients of the original per pixel
+//   mean_correction : mean of |blurred - original|
+//   changed_blocks  : fraction of the 8x8 blocks changed by the blur
+void MosquitoNR::MeasureStats()
+{
+	__int64 correction = 0, detail = 0;
+	for (int i = 0; i < threads; ++i) correction += stat_correction[i], detail += stat_detail[i];
+	int changed = 0;
+	for (int i = 0; i < total_blocks; ++i) changed += changed_map[i];
+
+	const double pixels = double(width) * height;
+	frame_stats.detail_energy   = double(detail) / (256.0 * pixels);
+	frame_stats.mean_correction = double(correction) / (16.0 * pixels);
+	frame_stats.changed_blocks  = double(changed) / total_blocks;
+}
+
+// publish the statistics of a frame as script variables (those of the enabled options)
+void MosquitoNR::PublishStats(IScriptEnvironment* env, const FrameStats& s)
+{
+	if (skip_blocks) env->SetVar("MosquitoNR_skipped_blocks", s.skipped);
+	if (incremental) env->SetVar("MosquitoNR_reused_blocks",  s.reused);
+	if (stats) {
+		env->SetVar("MosquitoNR_detail_energy",   s.detail_energy);
+		env->SetVar("MosquitoNR_mean_correction", s.mean_correction);
+		env->SetVar("MosquitoNR_changed_blocks",  s.changed_blocks);
+	}
+}
+
+// 8-bit fast mode (see smoothing_fast.cpp and wavelet_fast.cpp)
+void MosquitoNR::ProcessFast(IScriptEnvironment* env)
+{
+	CopyLumaFromFast();
+	mt.ExecMTFunc(smoothing);
+
+	if (restore != 0) {
+		mt.ExecMTFunc(&MosquitoNR::DownsampleFast<1>);
+		mt.ExecMTFunc(&MosquitoNR::DownsampleFast<2>);
+		mt.ExecMTFunc(&MosquitoNR::UpsampleFast);
+		mt.ExecMTFunc(&MosquitoNR::RestoreFast);
 	}
+}
+
+// run both the fast mode and the precise path on the first frames, and publish the maximum deviation
+// of luma as a script variable "MosquitoNR_max_deviation"
+void MosquitoNR::CheckDeviation(IScriptEnvironment* env)
+{
+	// each output is written while dst is its only reference (GetWritePtr fails otherwise)
+	PVideoFrame out = dst;
+	dst = env->NewVideoFrame(vi);
+	(this->*precise)(env);
+	PVideoFrame ref = dst;
+	dst = out;
+	out = NULL;
+	(this->*process)(env);
 
-	mt.ExecMTFunc(&MosquitoNR::InvWaveletHorz);
-	mt.ExecMTFunc(&MosquitoNR::InvWaveletVert);
-	CopyLumaTo();
+	const BYTE* p = ref->GetReadPtr() + roi_y * ref->GetPitch() + roi_x;
+	const BYTE* q = dst->GetReadPtr() + roi_y * dst->GetPitch() + roi_x;
+	for (int y = 0; y < height; ++y, p += ref->GetPitch(), q += dst->GetPitch())
+		for (int x = 0; x < width; ++x)
+			max_deviation = max(max_deviation, abs(p[x] - q[x]));
 
-	return dst;
+	++fast_checked;
+	env->SetVar("MosquitoNR_max_deviation", max_deviation);
 }
 
 void MosquitoNR::InitBuffer()
 {
-	luma[0] = luma[1] = bufy[0] = bufy[1] = bufx[0] = bufx[1] = NULL;
-	for (int i = 0; i < MAX_THREADS; ++i) work[i] = NULL;
+	luma[0] = luma[1] = bufy[0] = bufy[1] = bufx[0] = bufx[1] = bufa = NULL;
+	prev_luma = prev_blur = prev_restored = NULL;
+	block_flags = prev_flags = NULL;
+	strip_action = strip_forward = strip_horz = NULL;
+	var_blur = var_restore = NULL;
+	changed_map = NULL;
+	direction_map = NULL;
+	chroma = NULL;
+	fluma[0] = fluma[1] = fbuf[0] = fbuf[1] = NULL;
+	for (int l = 0; l <= MAX_LEVELS; ++l) lift[l] = liftd[l] = NULL;
+	lbuf = NULL;
+	for (int i = 0; i < MAX_THREADS; ++i) work[i] = NULL, fwork[i] = NULL, wide[i] = NULL;
 }
 
 bool MosquitoNR::AllocBuffer()
 {
 	FreeBuffer();
 
+	// planes of the lifting engine, or the low-pass filter
+	if (lowpass != LOWPASS_NONE) {
+		lbuf = (float*)_aligned_malloc(height * pitch * sizeof(float), 16);
+		if (!lbuf) return false;
+		memset(lbuf, 0, height * pitch * sizeof(float));
+	}
+	else if (use_lifting) {
+		lift_w[0] = width, lift_h[0] = height;
+		for (int l = 1; l <= levels; ++l) {
+			lift_w[l] = (lift_w[l-1] + 1) / 2;
+			lift_h[l] = (lift_h[l-1] + 1) / 2;
+			lift[l] = (float*)_aligned_malloc(lift_h[l-1] * pitch * sizeof(float), 16);
+			if (!lift[l]) return false;
+			memset(lift[l], 0, lift_h[l-1] * pitch * sizeof(float));
+			if (DetailWeight(l) != 0) {
+				liftd[l] = (float*)_aligned_malloc(lift_h[l-1] * pitch * sizeof(float), 16);
+				if (!liftd[l]) return false;
+				memset(liftd[l], 0, lift_h[l-1] * pitch * sizeof(float));
+			}
+		}
+	}
+
+	// 2 rows of float input, a row and its even/odd samples of the lifting engine,
+	// or the running sums of the low-pass filter
+	if (bits == 32 || use_lifting || lowpass != LOWPASS_NONE) {
+		const int rows = lowpass != LOWPASS_NONE ? (1 << levels) + 6 : 4;
+		for (int i = 0; i < threads; ++i) {
+			fwork[i] = (float*)_aligned_malloc(rows * pitch * sizeof(float), 16);
+			if (!fwork[i]) return false;
+			memset(fwork[i], 0, rows * pitch * sizeof(float));
+		}
+	}
+
+	if (bits == 32) {
+		const int size[4] = { height + 4, height + 4, (height + 1) / 2 + 4, (height + 3) / 4 + 4 };
+		float** buf[4] = { &fluma[0], &fluma[1], &fbuf[0], &fbuf[1] };
+		for (int i = 0; i < 4; ++i) {
+			*buf[i] = (float*)_aligned_malloc(size[i] * pitch * sizeof(float), 16);
+			if (!*buf[i]) return false;
+			memset(*buf[i], 0, size[i] * pitch * sizeof(float));	// no denormals in the padding
+		}
+		return true;
+	}
+
 	luma[0] = (short*)_aligned_malloc(( ((height +  7) &~  7)      + 4) * pitch * sizeof(short), 16);
 	luma[1] = (short*)_aligned_malloc(( ((height +  7) &~  7)      + 4) * pitch * sizeof(short), 16);
 	bufy[0] = (short*)_aligned_malloc(((((height + 15) &~ 15) / 2) + 1) * pitch * sizeof(short), 16);
@@ -140,21 +964,91 @@ bool MosquitoNR::AllocBuffer()
 
 	if (!luma[0] || !luma[1] || !bufy[0] || !bufy[1] || !bufx[0] || !bufx[1]) return false;
 
+	// the original is compared with the next frame, or read after restoring
+	if (incremental || variants || mask || output == OUTPUT_DIFF || output == OUTPUT_BOTH) {
+		bufa = (short*)_aligned_malloc((((height + 15) &~ 15) / 4) * pitch * sizeof(short), 16);
+		if (!bufa) return false;
+	}
+
+	if (output == OUTPUT_DIRECTION) {
+		direction_pitch = (width + 15) &~ 15;
+		direction_map = (BYTE*)_aligned_malloc(2 * height * direction_pitch, 16);
+		if (!direction_map) return false;
+	}
+
+	if (stats) {
+		changed_map = (BYTE*)_aligned_malloc(((width + 7) / 8) * ((height + 7) / 8), 16);
+		if (!changed_map) return false;
+	}
+
+	// blur and restoring of the analysis of variants
+	if (variants) {
+		var_blur    = (short*)_aligned_malloc((((height + 7) &~ 7) + 4) * pitch * sizeof(short), 16);
+		var_restore = (short*)_aligned_malloc((((height + 7) &~ 7) + 4) * pitch * sizeof(short), 16);
+		if (!var_blur || !var_restore) return false;
+	}
+
+	// source, blur and restored output of the previous frame
+	if (incremental) {
+		prev_luma = (short*)_aligned_malloc((((height + 7) &~ 7) + 4) * pitch * sizeof(short), 16);
+		prev_blur = (short*)_aligned_malloc((((height + 7) &~ 7) + 4) * pitch * sizeof(short), 16);
+		prev_restored = (short*)_aligned_malloc((((height + 7) &~ 7) + 4) * pitch * sizeof(short), 16);
+		prev_flags = (BYTE*)_aligned_malloc(((width + 7) / 8) * ((height + 7) / 8), 16);
+		if (!prev_luma || !prev_blur || !prev_restored || !prev_flags) return false;
+	}
+
+	// classified blocks, and the strips of restoring they skip
+	if (skip_blocks) {
+		const int strips = (height + 7) / 8;
+		block_flags   = (BYTE*)_aligned_malloc(((width + 7) / 8) * strips, 16);
+		strip_action  = (BYTE*)_aligned_malloc(strips, 16);
+		strip_forward = (BYTE*)_aligned_malloc(strips, 16);
+		strip_horz    = (BYTE*)_aligned_malloc((strips + 1) / 2, 16);
+		if (!block_flags || !strip_action || !strip_forward || !strip_horz) return false;
+	}
+
+	if (vi.IsYUY2()) {
+		chroma = (BYTE*)_aligned_malloc(height * pitch, 16);
+		if (!chroma) return false;
+	}
+
 	for (int i = 0; i < threads; ++i) {
 		work[i] = (short*)_aligned_malloc(8 * pitch * sizeof(short), 16);
 		if (!work[i]) return false;
 	}
 
+	// [direction][row parity][sum, variation] for each line crossing the rows of a thread
+	if (max_radius > 2) {
+		wide_pitch = ((width + 3) &~ 3) + 2 * height + 16;
+		for (int i = 0; i < threads; ++i) {
+			wide[i] = (int*)_aligned_malloc(32 * wide_pitch * sizeof(int), 16);
+			if (!wide[i]) return false;
+			memset(wide[i], 0, 32 * wide_pitch * sizeof(int));
+		}
+	}
+
 	return true;
 }
 
 void MosquitoNR::FreeBuffer()
 {
 	_aligned_free(luma[0]); _aligned_free(luma[1]);
+	_aligned_free(prev_luma); _aligned_free(prev_blur); _aligned_free(prev_restored);
+	_aligned_free(block_flags); _aligned_free(prev_flags);
+	_aligned_free(strip_action); _aligned_free(strip_forward); _aligned_free(strip_horz);
+	_aligned_free(var_blur);  _aligned_free(var_restore);
+	_aligned_free(changed_map);
+	_aligned_free(direction_map);
 	_aligned_free(bufy[0]); _aligned_free(bufy[1]);
 	_aligned_free(bufx[0]); _aligned_free(bufx[1]);
+	_aligned_free(bufa);
+	_aligned_free(chroma);
+	_aligned_free(fluma[0]); _aligned_free(fluma[1]);
+	_aligned_free(fbuf[0]);  _aligned_free(fbuf[1]);
+	for (int l = 1; l <= MAX_LEVELS; ++l) _aligned_free(lift[l]), _aligned_free(liftd[l]);
+	_aligned_free(lbuf);
 
-	for (int i = 0; i < threads; ++i) _aligned_free(work[i]);
+	for (int i = 0; i < threads; ++i) _aligned_free(work[i]), _aligned_free(fwork[i]), _aligned_free(wide[i]);
 
 	InitBuffer();
 }
@@ -172,32 +1066,110 @@ void MosquitoNR::CPUCheck()
 	ssse3 = (tmp & 0x200) != 0;
 }
 
+// horizontal reflection of 3-8 pixels for radius 3-8 (2 pixels are reflected by the input stages)
+void MosquitoNR::ReflectWide(short* p)
+{
+	for (int i = 3; i <= 8; ++i) p[-i] = p[i], p[width-1+i] = p[width-1-i];
+}
+
 void MosquitoNR::CopyLumaFrom()
 {
-	const int src_pitch = src->GetPitch();
+	const int src_pitch = SrcFrame()->GetPitch();
 	const int dst_pitch = pitch * sizeof(short);
 	const int height = this->height;
-	const BYTE* srcp = src->GetReadPtr();
+	const BYTE* srcp = SrcLuma();
+	const int hloop = (width + 15) / 16;
 	short* dstp = luma[0];
 
-	if (vi.IsYUY2())	// YUY2
+	__asm
 	{
-		const int hloop = (width + 7) / 8;
+		mov			rsi, srcp			// esi = srcp
+		mov			rdi, dstp
+		mov			eax, src_pitch		// eax = src_pitch
+		mov			ebx, dst_pitch		// ebx = pitch * sizeof(short)
+		mov			ecx, height			// ecx = height
+		lea			rdi, [rdi+2*rbx+16]	// edi = dstp + 2 * pitch + 8
+		pxor		xmm7, xmm7			// xmm7 = [0x00] * 16
+
+align 16
+nextrow_planar:
+#if !defined(_WIN64)
+		push		esi
+		push		edi
+#else
+		mov			r12, rsi
+		mov			r13, rdi
+#endif
+		mov			edx, hloop			// edx = hloop
+
+align 16
+next16pixels_planar:
+		movdqu		xmm0, [rsi]
+		movdqa		xmm1, xmm0
+		punpcklbw	xmm0, xmm7
+		punpckhbw	xmm1, xmm7
+		psllw		xmm0, 4				// convert to internal 12-bit precision
+		psllw		xmm1, 4
+		movdqa		[rdi], xmm0
+		movdqa		[rdi+16], xmm1
+		add			esi, 16
+		add			edi, 32
+		sub			edx, 1
+		jnz			next16pixels_planar
+
+#if !defined(_WIN64)
+		pop			edi
+		pop			esi
+#else
+		mov			rdi, r13
+		mov			rsi, r12
+#endif
+		add			rsi, rax
+		add			rdi, rbx
+		sub			ecx, 1
+		jnz			nextrow_planar
+	}
+
+	// horizontal reflection
+	short* p = luma[0] + 2 * pitch + 8;
+	for (int y = 0; y < height; ++y, p += pitch) {
+		p[-2] = p[2], p[-1] = p[1], p[width] = p[width-2], p[width+1] = p[width-3];
+		if (radius > 2) ReflectWide(p);
+	}
+
+	// vertical reflection
+	memcpy(luma[0],         luma[0] + 4 * pitch, pitch * sizeof(short));
+	memcpy(luma[0] + pitch, luma[0] + 3 * pitch, pitch * sizeof(short));
+	memcpy(luma[0] + (height + 2) * pitch, luma[0] +  height      * pitch, pitch * sizeof(short));
+	memcpy(luma[0] + (height + 3) * pitch, luma[0] + (height - 1) * pitch, pitch * sizeof(short));
+}
+
+template<bool STREAM>
+void MosquitoNR::CopyLumaTo()
+{
+	const int src_pitch = pitch * sizeof(short);
+	const int dst_pitch = dst->GetPitch();
+	const int height = this->height;
+	short* srcp = luma[1];
+	const int hloop = (width + 15) / 16;
+	BYTE* dstp = DstLuma();
 
+	if (STREAM) {
+		// the output frame is not read again soon, so it bypasses the cache
 		__asm
 		{
-			mov			rsi, srcp			// esi = srcp
-			mov			rdi, dstp
-			mov			eax, src_pitch		// eax = src_pitch
-			mov			ebx, dst_pitch		// ebx = pitch * sizeof(short)
+			mov			rsi, srcp
+			mov			rdi, dstp			// edi = dstp
+			mov			eax, src_pitch		// eax = pitch * sizeof(short)
+			mov			ebx, dst_pitch		// ebx = dst_pitch
 			mov			ecx, height			// ecx = height
-			lea			rdi, [rdi+2*rbx+16]	// edi = dstp + 2 * pitch + 8
-			mov			edx, 00ff00ffh
+			lea			rsi, [rsi+2*rax+16]	// esi = srcp + 2 * pitch + 8
+			mov			edx, 00080008h
 			movd		xmm7, edx
-			pshufd		xmm7, xmm7, 0		// xmm7 = [0x00ff] * 8
+			pshufd		xmm7, xmm7, 0		// xmm7 = [0x0008] * 8
 
 align 16
-nextrow_yuy2:
+nextrow_planar_nt:
 #if !defined(_WIN64)
 			push		esi
 			push		edi
@@ -208,15 +1180,19 @@ nextrow_yuy2:
 			mov			edx, hloop			// edx = hloop
 
 align 16
-next8pixels_yuy2:
-			movdqu		xmm0, [rsi]			// VYUYVYUYVYUYVYUY
-			pand		xmm0, xmm7			// -Y-Y-Y-Y-Y-Y-Y-Y
-			psllw		xmm0, 4				// convert to internal 12-bit precision
-			movdqa		[rdi], xmm0
-			add			rsi, 16
+next16pixels_planar_nt:
+			movdqa		xmm0, [rsi]
+			movdqa		xmm1, [rsi+16]
+			paddw		xmm0, xmm7
+			paddw		xmm1, xmm7
+			psraw		xmm0, 4
+			psraw		xmm1, 4
+			packuswb	xmm0, xmm1
+			movntdq		[rdi], xmm0
+			add			rsi, 32
 			add			rdi, 16
 			sub			edx, 1
-			jnz			next8pixels_yuy2
+			jnz			next16pixels_planar_nt
 
 #if !defined(_WIN64)
 			pop			edi
@@ -228,22 +1204,21 @@ next8pixels_yuy2:
 			add			rsi, rax
 			add			rdi, rbx
 			sub			ecx, 1
-			jnz			nextrow_yuy2
+			jnz			nextrow_planar_nt
+			sfence
 		}
-	}
-	else	// planar format
-	{
-		const int hloop = (width + 15) / 16;
-
+	} else {
 		__asm
 		{
-			mov			rsi, srcp			// esi = srcp
-			mov			rdi, dstp
-			mov			eax, src_pitch		// eax = src_pitch
-			mov			ebx, dst_pitch		// ebx = pitch * sizeof(short)
+			mov			rsi, srcp
+			mov			rdi, dstp			// edi = dstp
+			mov			eax, src_pitch		// eax = pitch * sizeof(short)
+			mov			ebx, dst_pitch		// ebx = dst_pitch
 			mov			ecx, height			// ecx = height
-			lea			rdi, [rdi+2*rbx+16]	// edi = dstp + 2 * pitch + 8
-			pxor		xmm7, xmm7			// xmm7 = [0x00] * 16
+			lea			rsi, [rsi+2*rax+16]	// esi = srcp + 2 * pitch + 8
+			mov			edx, 00080008h
+			movd		xmm7, edx
+			pshufd		xmm7, xmm7, 0		// xmm7 = [0x0008] * 8
 
 align 16
 nextrow_planar:
@@ -258,16 +1233,16 @@ nextrow_planar:
 
 align 16
 next16pixels_planar:
-			movdqu		xmm0, [rsi]
-			movdqa		xmm1, xmm0
-			punpcklbw	xmm0, xmm7
-			punpckhbw	xmm1, xmm7
-			psllw		xmm0, 4				// convert to internal 12-bit precision
-			psllw		xmm1, 4
+			movdqa		xmm0, [rsi]
+			movdqa		xmm1, [rsi+16]
+			paddw		xmm0, xmm7
+			paddw		xmm1, xmm7
+			psraw		xmm0, 4
+			psraw		xmm1, 4
+			packuswb	xmm0, xmm1
 			movdqa		[rdi], xmm0
-			movdqa		[rdi+16], xmm1
-			add			esi, 16
-			add			edi, 32
+			add			rsi, 32
+			add			rdi, 16
 			sub			edx, 1
 			jnz			next16pixels_planar
 
@@ -284,11 +1259,75 @@ next16pixels_planar:
 			jnz			nextrow_planar
 		}
 	}
+}
+
+// luma of 16-bit samples
+void MosquitoNR::CopyLumaFrom16()
+{
+	const int src_pitch = SrcFrame()->GetPitch();
+	const int dst_pitch = pitch * sizeof(short);
+	const int height = this->height;
+	const int round = in_round * 0x10001;
+	const int shift_r = in_shift_r, shift_l = in_shift_l;
+	const BYTE* srcp = SrcLuma();
+	const int hloop = (width + 7) / 8;
+	short* dstp = luma[0];
+
+	__asm
+	{
+		mov			rsi, srcp			// esi = srcp
+		mov			rdi, dstp
+		mov			eax, src_pitch		// eax = src_pitch
+		mov			ebx, dst_pitch		// ebx = pitch * sizeof(short)
+		mov			ecx, height			// ecx = height
+		lea			rdi, [rdi+2*rbx+16]	// edi = dstp + 2 * pitch + 8
+		movd		xmm7, round
+		pshufd		xmm7, xmm7, 0		// xmm7 = [in_round] * 8
+		movd		xmm6, shift_r
+		movd		xmm5, shift_l
+
+align 16
+nextrow_16:
+#if !defined(_WIN64)
+		push		esi
+		push		edi
+#else
+		mov			r12, rsi
+		mov			r13, rdi
+#endif
+		mov			edx, hloop			// edx = hloop
+
+align 16
+next8pixels_16:
+		movdqu		xmm0, [rsi]
+		paddusw		xmm0, xmm7
+		psrlw		xmm0, xmm6			// convert to internal 12-bit precision
+		psllw		xmm0, xmm5
+		movdqa		[rdi], xmm0
+		add			rsi, 16
+		add			rdi, 16
+		sub			edx, 1
+		jnz			next8pixels_16
+
+#if !defined(_WIN64)
+		pop			edi
+		pop			esi
+#else
+		mov			rdi, r13
+		mov			rsi, r12
+#endif
+		add			rsi, rax
+		add			rdi, rbx
+		sub			ecx, 1
+		jnz			nextrow_16
+	}
 
 	// horizontal reflection
 	short* p = luma[0] + 2 * pitch + 8;
-	for (int y = 0; y < height; ++y, p += pitch)
+	for (int y = 0; y < height; ++y, p += pitch) {
 		p[-2] = p[2], p[-1] = p[1], p[width] = p[width-2], p[width+1] = p[width-3];
+		if (radius > 2) ReflectWide(p);
+	}
 
 	// vertical reflection
 	memcpy(luma[0],         luma[0] + 4 * pitch, pitch * sizeof(short));
@@ -297,164 +1336,531 @@ next16pixels_planar:
 	memcpy(luma[0] + (height + 3) * pitch, luma[0] + (height - 1) * pitch, pitch * sizeof(short));
 }
 
-void MosquitoNR::CopyLumaTo()
+template<bool STREAM>
+void MosquitoNR::CopyLumaTo16()
 {
 	const int src_pitch = pitch * sizeof(short);
 	const int dst_pitch = dst->GetPitch();
 	const int height = this->height;
+	const int round = out_round * 0x10001, maximum = out_max * 0x10001;
+	const int shift_r = out_shift_r, shift_l = out_shift_l;
 	short* srcp = luma[1];
-	BYTE* dstp = dst->GetWritePtr();
-
-	if (vi.IsYUY2())	// YUY2
-	{
-		const int src_pitch2 = src->GetPitch();
-		const int hloop = (width + 7) / 8;
-		const BYTE* srcp2 = src->GetReadPtr();
+	const int hloop = (width + 7) / 8;
+	BYTE* dstp = DstLuma();
 
+	if (STREAM) {
+		// the output frame is not read again soon, so it bypasses the cache
 		__asm
 		{
 			mov			rsi, srcp
-			mov			rbx, srcp2			// ebx = srcp2
 			mov			rdi, dstp			// edi = dstp
 			mov			eax, src_pitch		// eax = pitch * sizeof(short)
+			mov			ebx, dst_pitch		// ebx = dst_pitch
 			mov			ecx, height			// ecx = height
 			lea			rsi, [rsi+2*rax+16]	// esi = srcp + 2 * pitch + 8
-			mov			edx, 000ff00ffh
-			movd		xmm5, edx
-			mov			edx, 0ff00ff00h
-			movd		xmm6, edx
-			mov			edx, 000080008h
-			movd		xmm7, edx
-			pxor		xmm4, xmm4			// xmm4 = [0x0000] * 8
-			pshufd		xmm5, xmm5, 0		// xmm5 = [0x00ff] * 8
-			pshufd		xmm6, xmm6, 0		// xmm6 = [0xff00] * 8
-			pshufd		xmm7, xmm7, 0		// xmm7 = [0x0008] * 8
-#if defined(_WIN64)
-			mov			r8d, src_pitch2
-			mov			r9d, dst_pitch
-#endif
+			movd		xmm7, round
+			pshufd		xmm7, xmm7, 0		// xmm7 = [out_round] * 8
+			movd		xmm6, maximum
+			pshufd		xmm6, xmm6, 0		// xmm6 = [out_max] * 8
+			pxor		xmm5, xmm5			// xmm5 = [0x0000] * 8
+			movd		xmm4, shift_r
+			movd		xmm3, shift_l
 
 align 16
-nextrow_yuy2:
+nextrow_16_nt:
 #if !defined(_WIN64)
 			push		esi
-			push		ebx
 			push		edi
 #else
 			mov			r12, rsi
 			mov			r13, rdi
-			mov			r14, rbx
 #endif
 			mov			edx, hloop			// edx = hloop
 
 align 16
-next8pixels_yuy2:
+next8pixels_16_nt:
 			movdqa		xmm0, [rsi]
-			movdqu		xmm1, [rbx]
 			paddw		xmm0, xmm7
-			psraw		xmm0, 4
-			pmaxsw		xmm0, xmm4
-			pminsw		xmm0, xmm5			// -Y-Y-Y-Y-Y-Y-Y-Y
-			pand		xmm1, xmm6			// V-U-V-U-V-U-V-U-
-			por			xmm0, xmm1			// VYUYVYUYVYUYVYUY
-			movdqa		[rdi], xmm0
+			psraw		xmm0, xmm4
+			pmaxsw		xmm0, xmm5
+			pminsw		xmm0, xmm6
+			psllw		xmm0, xmm3
+			movntdq		[rdi], xmm0
 			add			rsi, 16
-			add			rbx, 16
 			add			rdi, 16
 			sub			edx, 1
-			jnz			next8pixels_yuy2
+			jnz			next8pixels_16_nt
 
 #if !defined(_WIN64)
 			pop			edi
-			pop			ebx
 			pop			esi
 #else
-			mov			rbx, r14
 			mov			rdi, r13
 			mov			rsi, r12
 #endif
 			add			rsi, rax
+			add			rdi, rbx
+			sub			ecx, 1
+			jnz			nextrow_16_nt
+			sfence
+		}
+	} else {
+		__asm
+		{
+			mov			rsi, srcp
+			mov			rdi, dstp			// edi = dstp
+			mov			eax, src_pitch		// eax = pitch * sizeof(short)
+			mov			ebx, dst_pitch		// ebx = dst_pitch
+			mov			ecx, height			// ecx = height
+			lea			rsi, [rsi+2*rax+16]	// esi = srcp + 2 * pitch + 8
+			movd		xmm7, round
+			pshufd		xmm7, xmm7, 0		// xmm7 = [out_round] * 8
+			movd		xmm6, maximum
+			pshufd		xmm6, xmm6, 0		// xmm6 = [out_max] * 8
+			pxor		xmm5, xmm5			// xmm5 = [0x0000] * 8
+			movd		xmm4, shift_r
+			movd		xmm3, shift_l
+
+align 16
+nextrow_16:
 #if !defined(_WIN64)
-			add			ebx, src_pitch2
-			add			edi, dst_pitch
+			push		esi
+			push		edi
 #else
-			add			rbx, r8
-			add			rdi, r9
+			mov			r12, rsi
+			mov			r13, rdi
 #endif
+			mov			edx, hloop			// edx = hloop
+
+align 16
+next8pixels_16:
+			movdqa		xmm0, [rsi]
+			paddw		xmm0, xmm7
+			psraw		xmm0, xmm4
+			pmaxsw		xmm0, xmm5
+			pminsw		xmm0, xmm6
+			psllw		xmm0, xmm3
+			movdqa		[rdi], xmm0
+			add			rsi, 16
+			add			rdi, 16
+			sub			edx, 1
+			jnz			next8pixels_16
+
+#if !defined(_WIN64)
+			pop			edi
+			pop			esi
+#else
+			mov			rdi, r13
+			mov			rsi, r12
+#endif
+			add			rsi, rax
+			add			rdi, rbx
 			sub			ecx, 1
-			jnz			nextrow_yuy2
+			jnz			nextrow_16
 		}
 	}
-	else	// planar format
+}
+
+// original - output + 2048 (the correction biased to the middle of the range, 1 << (bits - 1) after
+// the scaling to the output samples) -> luma of the output frame
+// (below the filtered frame for "both")
+template<bool STREAM>
+void MosquitoNR::CopyDiff(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int dst_pitch = dst->GetPitch();
+	const __m128i bias    = _mm_set1_epi16(2048);
+	const __m128i round   = _mm_set1_epi16(out_bytes == 1 ? 8 : out_round);
+	const __m128i maximum = _mm_set1_epi16(out_bytes == 1 ? 255 : out_max);
+	const __m128i shift_r = _mm_cvtsi32_si128(out_bytes == 1 ? 4 : out_shift_r);
+	const __m128i shift_l = _mm_cvtsi32_si128(out_bytes == 1 ? 0 : out_shift_l);
+	BYTE* dstp = DstLuma() + ((output == OUTPUT_BOTH ? frame_height : 0) + y_start) * dst_pitch;
+
+	for (int y = y_start; y < y_end; ++y, dstp += dst_pitch)
+	{
+		const short* p = luma[0] + (y + 2) * pitch + 8;
+		const short* q = luma[1] + (y + 2) * pitch + 8;
+
+		for (int x = 0; x < width; x += 8) {
+			__m128i v = _mm_add_epi16(_mm_sub_epi16(_mm_load_si128((const __m128i*)(p + x)), _mm_load_si128((const __m128i*)(q + x))), bias);
+			v = _mm_sra_epi16(_mm_add_epi16(v, round), shift_r);
+			v = _mm_sll_epi16(_mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()), maximum), shift_l);
+
+			if (out_bytes == 1) {
+				// 16 pixels at a time
+				const __m128i w = _mm_add_epi16(_mm_sub_epi16(_mm_load_si128((const __m128i*)(p + x + 8)), _mm_load_si128((const __m128i*)(q + x + 8))), bias);
+				v = _mm_packus_epi16(v, _mm_sra_epi16(_mm_add_epi16(w, round), shift_r));
+				if (STREAM) _mm_stream_si128((__m128i*)(dstp + x), v);
+				else        _mm_store_si128((__m128i*)(dstp + x), v);
+				x += 8;
+			} else {
+				if (STREAM) _mm_stream_si128((__m128i*)(dstp + 2 * x), v);
+				else        _mm_store_si128((__m128i*)(dstp + 2 * x), v);
+			}
+		}
+	}
+
+	if (STREAM) _mm_sfence();
+}
+
+template void MosquitoNR::CopyDiff<false>(int thread_id);
+template void MosquitoNR::CopyDiff<true >(int thread_id);
+
+// luma of float input
+void MosquitoNR::CopyLumaFromFloat()
+{
+	const int src_pitch = SrcFrame()->GetPitch();
+	const BYTE* srcp = SrcLuma();
+	float* dstp = fluma[0] + 2 * pitch + 8;
+
+	for (int y = 0; y < height; ++y, srcp += src_pitch, dstp += pitch) {
+		memcpy(dstp, srcp, width * sizeof(float));
+
+		// horizontal reflection
+		dstp[-2] = dstp[2], dstp[-1] = dstp[1], dstp[width] = dstp[width-2], dstp[width+1] = dstp[width-3];
+	}
+
+	// vertical reflection
+	memcpy(fluma[0],         fluma[0] + 4 * pitch, pitch * sizeof(float));
+	memcpy(fluma[0] + pitch, fluma[0] + 3 * pitch, pitch * sizeof(float));
+	memcpy(fluma[0] + (height + 2) * pitch, fluma[0] +  height      * pitch, pitch * sizeof(float));
+	memcpy(fluma[0] + (height + 3) * pitch, fluma[0] + (height - 1) * pitch, pitch * sizeof(float));
+}
+
+void MosquitoNR::CopyLumaToFloat()
+{
+	const int dst_pitch = dst->GetPitch();
+	const float* srcp = fluma[1] + 2 * pitch + 8;
+	BYTE* dstp = DstLuma();
+
+	for (int y = 0; y < height; ++y, srcp += pitch, dstp += dst_pitch)
+		memcpy(dstp, srcp, width * sizeof(float));
+}
+
+// luma of the fast mode (byte samples with 1 pixel of reflection)
+void MosquitoNR::CopyLumaFromFast()
+{
+	const int src_pitch = SrcFrame()->GetPitch();
+	const int dst_pitch = pitch * sizeof(short);
+	const BYTE* srcp = SrcLuma();
+	BYTE* top  = reinterpret_cast<BYTE*>(luma[0]);
+	BYTE* dstp = top + 2 * dst_pitch + 16;
+
+	for (int y = 0; y < height; ++y, srcp += src_pitch, dstp += dst_pitch) {
+		memcpy(dstp, srcp, width);
+
+		// horizontal reflection
+		dstp[-1] = dstp[1], dstp[width] = dstp[width-2];
+	}
+
+	// vertical reflection
+	memcpy(top +  dst_pitch,               top + 3 * dst_pitch,      dst_pitch);
+	memcpy(top + (height + 2) * dst_pitch, top + height * dst_pitch, dst_pitch);
+}
+
+// split YUY2 into the internal luma buffer and a packed chroma buffer
+// (the source frame is read only here)
+void MosquitoNR::UnpackYUY2(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int width = this->width;
+	const int pitch = this->pitch;
+	const int src_pitch = SrcFrame()->GetPitch();
+	const int dst_pitch = pitch * sizeof(short);
+	const int rows  = y_end - y_start;
+	const int hloop = (width + 7) / 8;
+	const BYTE* srcp = SrcLuma() + y_start * src_pitch;
+	short* dstp = luma[0] + (y_start + 2) * pitch + 8;
+	BYTE* chromap = chroma + y_start * pitch;
+
+	__asm
 	{
-		const int hloop = (width + 15) / 16;
+		mov			rsi, srcp			// esi = srcp
+		mov			rdi, dstp			// edi = dstp
+		mov			rdx, chromap		// edx = chromap
+		mov			eax, src_pitch		// eax = src_pitch
+		mov			ebx, dst_pitch		// ebx = pitch * sizeof(short)
+		mov			ecx, 00ff00ffh
+		movd		xmm7, ecx
+		pshufd		xmm7, xmm7, 0		// xmm7 = [0x00ff] * 8
+		mov			ecx, rows			// ecx = rows
+#if defined(_WIN64)
+		mov			r8d, pitch
+#endif
 
+align 16
+nextrow:
+#if !defined(_WIN64)
+		push		esi
+		push		edi
+		push		edx
+		push		ecx
+#else
+		mov			r12, rsi
+		mov			r13, rdi
+		mov			r14, rdx
+		mov			r15, rcx
+#endif
+		mov			ecx, hloop			// ecx = hloop
+
+align 16
+next8pixels:
+		movdqu		xmm0, [rsi]			// VYUYVYUYVYUYVYUY
+		movdqa		xmm1, xmm0
+		pand		xmm0, xmm7			// -Y-Y-Y-Y-Y-Y-Y-Y
+		psrlw		xmm1, 8				// -V-U-V-U-V-U-V-U
+		psllw		xmm0, 4				// convert to internal 12-bit precision
+		packuswb	xmm1, xmm1			// VUVUVUVU
+		movdqa		[rdi], xmm0
+		movq		qword ptr [rdx], xmm1
+		add			rsi, 16
+		add			rdi, 16
+		add			rdx, 8
+		sub			ecx, 1
+		jnz			next8pixels
+
+#if !defined(_WIN64)
+		pop			ecx
+		pop			edx
+		pop			edi
+		pop			esi
+#else
+		mov			rcx, r15
+		mov			rdx, r14
+		mov			rdi, r13
+		mov			rsi, r12
+#endif
+		add			rsi, rax
+		add			rdi, rbx
+#if !defined(_WIN64)
+		add			edx, pitch
+#else
+		add			rdx, r8
+#endif
+		sub			ecx, 1
+		jnz			nextrow
+	}
+
+	// horizontal reflection
+	short* p = dstp;
+	for (int y = y_start; y < y_end; ++y, p += pitch) {
+		p[-2] = p[2], p[-1] = p[1], p[width] = p[width-2], p[width+1] = p[width-3];
+		if (radius > 2) ReflectWide(p);
+	}
+
+	// vertical reflection
+	if (y_start <= 1 && 1 < y_end)
+		memcpy(luma[0] + pitch, luma[0] + 3 * pitch, pitch * sizeof(short));
+	if (y_start <= 2 && 2 < y_end)
+		memcpy(luma[0],         luma[0] + 4 * pitch, pitch * sizeof(short));
+	if (y_start <= height - 3 && height - 3 < y_end)
+		memcpy(luma[0] + (height + 3) * pitch, luma[0] + (height - 1) * pitch, pitch * sizeof(short));
+	if (y_start <= height - 2 && height - 2 < y_end)
+		memcpy(luma[0] + (height + 2) * pitch, luma[0] +  height      * pitch, pitch * sizeof(short));
+}
+
+// interleave the processed luma with the chroma saved by UnpackYUY2
+template<bool STREAM>
+void MosquitoNR::PackYUY2(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int pitch = this->pitch;
+	const int src_pitch = pitch * sizeof(short);
+	const int dst_pitch = dst->GetPitch();
+	const int rows  = y_end - y_start;
+	const int hloop = (width + 7) / 8;
+	short* srcp = luma[1] + (y_start + 2) * pitch + 8;
+	BYTE* chromap = chroma + y_start * pitch;
+	BYTE* dstp = DstLuma() + y_start * dst_pitch;
+
+	if (STREAM) {
+		// the output frame is not read again soon, so it bypasses the cache
 		__asm
 		{
-			mov			rsi, srcp
+			mov			rsi, srcp			// esi = srcp
+			mov			rdx, chromap		// edx = chromap
 			mov			rdi, dstp			// edi = dstp
 			mov			eax, src_pitch		// eax = pitch * sizeof(short)
 			mov			ebx, dst_pitch		// ebx = dst_pitch
-			mov			ecx, height			// ecx = height
-			lea			rsi, [rsi+2*rax+16]	// esi = srcp + 2 * pitch + 8
-			mov			edx, 00080008h
-			movd		xmm7, edx
+			mov			ecx, 00080008h
+			movd		xmm7, ecx
 			pshufd		xmm7, xmm7, 0		// xmm7 = [0x0008] * 8
+			mov			ecx, rows			// ecx = rows
+#if defined(_WIN64)
+			mov			r8d, pitch
+#endif
 
 align 16
-nextrow_planar:
+nextrow_nt:
 #if !defined(_WIN64)
 			push		esi
 			push		edi
+			push		edx
+			push		ecx
 #else
 			mov			r12, rsi
 			mov			r13, rdi
+			mov			r14, rdx
+			mov			r15, rcx
 #endif
-			mov			edx, hloop			// edx = hloop
+			mov			ecx, hloop			// ecx = hloop
 
 align 16
-next16pixels_planar:
+next8pixels_nt:
 			movdqa		xmm0, [rsi]
-			movdqa		xmm1, [rsi+16]
+			movq		xmm1, qword ptr [rdx]
 			paddw		xmm0, xmm7
-			paddw		xmm1, xmm7
 			psraw		xmm0, 4
-			psraw		xmm1, 4
-			packuswb	xmm0, xmm1
+			packuswb	xmm0, xmm0
+			punpcklbw	xmm0, xmm1
+			movntdq		[rdi], xmm0
+			add			rsi, 16
+			add			rdx, 8
+			add			rdi, 16
+			sub			ecx, 1
+			jnz			next8pixels_nt
+
+#if !defined(_WIN64)
+			pop			ecx
+			pop			edx
+			pop			edi
+			pop			esi
+#else
+			mov			rcx, r15
+			mov			rdx, r14
+			mov			rdi, r13
+			mov			rsi, r12
+#endif
+			add			rsi, rax
+			add			rdi, rbx
+#if !defined(_WIN64)
+			add			edx, pitch
+#else
+			add			rdx, r8
+#endif
+			sub			ecx, 1
+			jnz			nextrow_nt
+			sfence
+		}
+	} else {
+		__asm
+		{
+			mov			rsi, srcp			// esi = srcp
+			mov			rdx, chromap		// edx = chromap
+			mov			rdi, dstp			// edi = dstp
+			mov			eax, src_pitch		// eax = pitch * sizeof(short)
+			mov			ebx, dst_pitch		// ebx = dst_pitch
+			mov			ecx, 00080008h
+			movd		xmm7, ecx
+			pshufd		xmm7, xmm7, 0		// xmm7 = [0x0008] * 8
+			mov			ecx, rows			// ecx = rows
+#if defined(_WIN64)
+			mov			r8d, pitch
+#endif
+
+align 16
+nextrow:
+#if !defined(_WIN64)
+			push		esi
+			push		edi
+			push		edx
+			push		ecx
+#else
+			mov			r12, rsi
+			mov			r13, rdi
+			mov			r14, rdx
+			mov			r15, rcx
+#endif
+			mov			ecx, hloop			// ecx = hloop
+
+align 16
+next8pixels:
+			movdqa		xmm0, [rsi]
+			movq		xmm1, qword ptr [rdx]	// VUVUVUVU
+			paddw		xmm0, xmm7
+			psraw		xmm0, 4
+			packuswb	xmm0, xmm0			// YYYYYYYY
+			punpcklbw	xmm0, xmm1			// VYUYVYUYVYUYVYUY
 			movdqa		[rdi], xmm0
-			add			rsi, 32
+			add			rsi, 16
+			add			rdx, 8
 			add			rdi, 16
-			sub			edx, 1
-			jnz			next16pixels_planar
+			sub			ecx, 1
+			jnz			next8pixels
 
 #if !defined(_WIN64)
+			pop			ecx
+			pop			edx
 			pop			edi
 			pop			esi
 #else
+			mov			rcx, r15
+			mov			rdx, r14
 			mov			rdi, r13
 			mov			rsi, r12
 #endif
 			add			rsi, rax
 			add			rdi, rbx
+#if !defined(_WIN64)
+			add			edx, pitch
+#else
+			add			rdx, r8
+#endif
 			sub			ecx, 1
-			jnz			nextrow_planar
+			jnz			nextrow
 		}
 	}
 }
 
-void MosquitoNR::Smoothing(int thread_id)
+// -1 for an unknown name
+static int WaveletFromName(const char* name)
+{
+	if (!lstrcmpi(name, "haar")) return WAVELET_HAAR;
+	if (!lstrcmpi(name, "5/3") || !lstrcmpi(name, "53")) return WAVELET_53;
+	if (!lstrcmpi(name, "9/7") || !lstrcmpi(name, "97")) return WAVELET_97;
+	return -1;
+}
+
+// -1 for an unknown name
+static int OutputFromName(const char* name)
+{
+	if (!lstrcmpi(name, "filtered" )) return OUTPUT_FILTERED;
+	if (!lstrcmpi(name, "diff"     )) return OUTPUT_DIFF;
+	if (!lstrcmpi(name, "both"     )) return OUTPUT_BOTH;
+	if (!lstrcmpi(name, "direction")) return OUTPUT_DIRECTION;
+	if (!lstrcmpi(name, "subbands" )) return OUTPUT_SUBBANDS;
+	return -1;
+}
+
+// -1 for an unknown name
+static int LowpassFromName(const char* name)
 {
-	if (ssse3) SmoothingSSSE3(thread_id);
-	else       SmoothingSSE2 (thread_id);
+	if (!lstrcmpi(name, "none" )) return LOWPASS_NONE;
+	if (!lstrcmpi(name, "box"  )) return LOWPASS_BOX;
+	if (!lstrcmpi(name, "gauss")) return LOWPASS_GAUSS;
+	return -1;
 }
 
 AVSValue __cdecl CreateMosquitoNR(AVSValue args, void* user_data, IScriptEnvironment* env)
 {
-	return new MosquitoNR(args[0].AsClip(), args[1].AsInt(16), args[2].AsInt(128), args[3].AsInt(2), args[4].AsInt(0), env);
+	return new MosquitoNR(args[0].AsClip(), args[1].AsInt(16), args[2].AsInt(128), args[3].AsInt(2), args[4].AsInt(0),
+		args[5].AsInt(-1), args[6].AsInt(-1), args[7].AsInt(0),
+		args[8].AsInt(args[7].AsInt(0) == 2 ? 10 : 8), args[9].AsBool(false), args[10].AsBool(false),
+		WaveletFromName(args[11].AsString("5/3")), args[12].AsInt(2), LowpassFromName(args[13].AsString("none")),
+		args[14].AsInt(0), args[15].AsInt(0), args[16].AsInt(0), args[17].Defined() ? args[17].AsClip() : PClip(),
+		args[18].AsInt(0), args[19].AsInt(0), args[20].AsInt(0), args[21].AsInt(0), args[22].AsInt(0), args[23].AsBool(false),
+		args[24].AsString(""), args[25].AsBool(false),
+		OutputFromName(args[26].AsString("filtered")), args[27].AsBool(false), env);
 }
 
 extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit2(IScriptEnvironment* env)
 {
-	env->AddFunction("MosquitoNR", "c[strength]i[restore]i[radius]i[threads]i", CreateMosquitoNR, NULL);
+	env->AddFunction("MosquitoNR", "c[strength]i[restore]i[radius]i[threads]i[stream]i[prefetch]i[semiplanar]i[bits]i[out16]b[fast]b[wavelet]s[levels]i[lowpass]s[restore1]i[restore2]i[flat]i[mask]c[x]i[y]i[w]i[h]i[cache]i[incremental]b[variants]s[stats]b[output]s[runtime]b", CreateMosquitoNR, NULL);
 	return "Mosquito noise reduction filter ver 0.10";
 }
@@ -29,8 +29,65 @@
 class MosquitoNR;
 
 typedef void (MosquitoNR::*MTFunc)(int thread_id);
+typedef void (MosquitoNR::*PipelineFunc)(IScriptEnvironment* env);
 
 const int MAX_THREADS = 32;
+const int MAX_TUNE    = 8;	// maximum number of benchmarked store/prefetch settings
+const int TUNE_ROUNDS = 3;	// frames measured per setting
+const int MAX_LEVELS  = 4;	// maximum decomposition depth of restoring
+const int MAX_CACHE   = 16;	// maximum number of cached output frames
+const int MAX_VARIANTS = 8;	// maximum number of strength/restore settings of one analysis
+
+// restoring modes (selected once at construction)
+enum { RESTORE_NONE, RESTORE_FULL, RESTORE_BLEND, RESTORE_LIFTING, RESTORE_LOWPASS };
+
+// wavelets of restoring (CDF 5/3 of 2 levels has asm kernels, the others use the lifting engine)
+enum { WAVELET_HAAR, WAVELET_53, WAVELET_97 };
+
+// low-pass filters used instead of the wavelet
+enum { LOWPASS_NONE, LOWPASS_BOX, LOWPASS_GAUSS };
+
+// 8-row strips of the asm restore stages (see PlanStrips)
+enum { STRIP_RUN, STRIP_KEEP, STRIP_REUSE };
+
+// contents of the output clip
+enum { OUTPUT_FILTERED, OUTPUT_DIRECTION, OUTPUT_SUBBANDS, OUTPUT_DIFF, OUTPUT_BOTH };
+
+// luma layouts of the input (and the output)
+enum { INPUT_PLANAR8, INPUT_YUY2, INPUT_PLANAR16, INPUT_PLANAR8_OUT16 };
+
+// store/prefetch setting of the bandwidth-bound stages
+struct TuneInfo
+{
+	bool nt_store;		// use non-temporal stores for write-once outputs
+	int prefetch;		// prefetch distance of the vertical passes in bytes
+	__int64 time;		// best measured time
+};
+
+// script variables of a frame (published again when its output is taken from the cache)
+struct FrameStats
+{
+	int skipped, reused;		// MosquitoNR_skipped_blocks/reused_blocks
+	double detail_energy, mean_correction, changed_blocks;	// stats
+};
+
+// output frame of a source (see frame_cache.cpp)
+struct CacheEntry
+{
+	unsigned __int64 hash[2];	// hash of the source luma
+	int params;					// parameters the frame was processed with
+	__int64 last_used;			// order of use (0: empty)
+	PVideoFrame frame;
+	FrameStats stats;
+};
+
+// rows of a chroma plane copied by the threads (see CopyChroma)
+struct PlaneCopy
+{
+	const BYTE* srcp;
+	BYTE* dstp;
+	int src_pitch, dst_pitch, row_size, rows;
+};
 
 struct ThreadInfo
 {
@@ -47,52 +104,205 @@ private:
 	int threads;
 	ThreadInfo th[MAX_THREADS];
 	HANDLE running[MAX_THREADS];
+	bool pending;				// a job started by StartMTFunc has not been waited for
 
 public:
 	MTInfo();
 	~MTInfo();
 	bool CreateThreads(int _threads, MosquitoNR* inst);
 	void ExecMTFunc(MTFunc mt_func);
+	void StartMTFunc(MTFunc mt_func);
+	void WaitMTFunc();
 };
 
 class MosquitoNR : public GenericVideoFilter
 {
 private:
-	const int strength, restore, radius;
+	int strength, restore, radius;	// current values (read per frame when runtime is on)
+	const int default_strength, default_restore, default_radius;	// values given to the filter
+	const int restore1, restore2;	// restore of the detail coefficients of level 1 and level 2 (or deeper)
 	int threads;
-	const int width, height;
+	const int stream, prefetch_dist;	// -1 means benchmarking
+	const int semiplanar;		// 1: NV12, 2: P010 (luma followed by interleaved UV rows)
+	const int bits;				// bit depth of input (9-12: 16-bit samples in a clip of double width, 32: float)
+	const bool out16;			// output 16-bit samples in a clip of double width
+	const bool fast;			// 8-bit fast mode (radius 1 only)
+	const int wavelet;			// WAVELET_*
+	const int levels;			// decomposition depth of restoring
+	const int lowpass;			// LOWPASS_* (radius 2^(levels-1))
+	const int flat;				// blocks of smaller range are not blurred (0: off)
+	PClip mask;					// only the area of nonzero mask is processed (optional)
+	const bool incremental;		// blocks unchanged from the previous frame are not blurred
+	int variants;				// number of strength/restore settings (0: off)
+	int variant_strength[MAX_VARIANTS], variant_restore[MAX_VARIANTS];
+	int variant;				// setting of the current output frame
+	int variant_frame;			// source frame of the analysis (-1: none)
+	int source_frame;			// source frame of the current output frame
+	short* var_blur;			// blurred luma data of the analysis
+	short* var_restore;			// restored luma data of the analysis
+	const bool stats;			// publish the statistics of each frame
+	const int output;			// OUTPUT_*
+	int stack;					// images stacked in the output frame (the filtered one on top, then the maps)
+	const bool runtime;			// strength/restore/radius are read from global variables per frame
+	int max_radius;				// largest radius allowed by the options and the buffers
+	BYTE* direction_map;		// selected direction of each pixel, followed by its SAD (OUTPUT_DIRECTION)
+	int direction_pitch;
+	__int64 stat_correction[MAX_THREADS];	// sum of |blurred - original| of each thread
+	__int64 stat_detail[MAX_THREADS];		// sum of the squared level-1 detail coefficients of each thread
+	BYTE* changed_map;			// 8x8 blocks changed by the blur
+	FrameStats frame_stats;		// script variables of the current frame
+	bool skip_blocks;			// blocks are classified by flat, mask or incremental
+	const int frame_width, frame_height;	// size of luma of the frame
+	const int roi_x, roi_y;		// top-left of the processed region
+	const int width, height;	// size of the processed region of luma
 	const int pitch;			// pitch of following buffers
+	int in_bytes, out_bytes;	// bytes per pixel of luma in the input/output frame
 	short* luma[2];				// original/blurred luma data
+	short* prev_luma;			// original luma data of the previous frame (swapped with luma[0])
+	short* prev_blur;			// blurred luma data of the previous frame
+	short* prev_restored;		// restored luma data of the previous frame (before the mask is applied)
+	BYTE* block_flags;			// flags of the 8x8 blocks of the current frame (see ClassifyBlocks)
+	BYTE* prev_flags;			// block_flags of the previous frame (swapped with it)
+	bool prev_valid;			// previous frame has been processed
 	short* bufy[2];				// vertical approximation/detail coefficients
 	short* bufx[2];				// shuffled horizontal approximation/detail coefficients of vertical approximation coefficients
+	short* bufa;				// approximation coefficients of the original when it is kept (otherwise in luma[0])
+	BYTE* strip_action;			// STRIP_* of each 8-row strip of the output of the asm restore stages
+	BYTE* strip_forward;		// 8-row strips run by the vertical forward stages
+	BYTE* strip_horz;			// 16-row strips run by the horizontal stages
 	short* work[MAX_THREADS];	// temporal buffer
+	BYTE* chroma;				// packed chroma of YUY2 input
+	float* fluma[2];			// original/blurred luma data of float input
+	float* fbuf[2];				// approximation coefficients of the difference (level 1/2)
+	float* fwork[MAX_THREADS];	// temporal buffer of float input
+	int* wide[MAX_THREADS];		// running sums of each line (radius 3-8)
+	int wide_pitch;				// pitch of the running sums
+	float* lift[MAX_LEVELS+1];	// planes of the lifting engine (level 1-levels)
+	float* liftd[MAX_LEVELS+1];	// horizontal detail coefficients of each level (restore1/restore2)
+	int lift_w[MAX_LEVELS+1], lift_h[MAX_LEVELS+1];	// size of each level (0: luma)
+	int lift_level;				// level processed by the lifting stages
+	bool use_lifting;			// restoring by the lifting engine
+	float* lbuf;				// vertical low-pass of the difference
+	int coef[4];				// smoothing coefficients of the selected radius
+	int multiplier;				// [128 - restore, restore] packed for pmaddwd
 	bool ssse3;
+	bool nt_store;				// selected store/prefetch setting
+	int prefetch;
+	int in_round, in_shift_r, in_shift_l;				// 16-bit samples -> internal 12-bit precision
+	int out_round, out_shift_r, out_max, out_shift_l;	// internal 12-bit precision -> 16-bit samples
+	int sad_shift;				// SADs of the direction search are scaled up to free their lower 3 bits
+	TuneInfo tune[MAX_TUNE];	// benchmarked settings
+	int tune_settings, tune_count;
+	MTFunc smoothing;			// specialized smoothing kernel
+	PipelineFunc process;		// specialized per-frame pipeline
+	PipelineFunc precise;		// pipeline of full precision (compared with the fast mode)
+	const MTFunc* lifting;		// lifting stages of the selected wavelet
+	const MTFunc* lowpass_stages;	// vertical/horizontal stages of the selected low-pass filter
+	int fast_checked;			// frames compared with the precise path
+	int max_deviation;			// maximum deviation of the fast mode from the precise path
+	int skip_count[MAX_THREADS];	// skipped blocks found by each thread
+	int reuse_count[MAX_THREADS];	// blocks copied from the previous frame by each thread
+	int total_blocks;			// number of 8x8 blocks of luma
+	const int cache_size;		// number of cached output frames (0: off)
+	CacheEntry cache[MAX_CACHE];
+	__int64 cache_clock;
+	int cache_hits, cache_requests;
+	bool in_place;				// the filtered luma may be written over the source frame (when it is writable)
+	PlaneCopy chroma_copy[2];	// chroma planes of the current frame
+	int chroma_planes;
 	MTInfo mt;
-	PVideoFrame src, dst;
+	PVideoFrame src, dst, mask_frame;
 
 	void InitBuffer();
 	bool AllocBuffer();
 	void FreeBuffer();
 	void CPUCheck();
-	void SmoothingSSE2(int thread_id);
-	void SmoothingSSSE3(int thread_id);
+	void SelectPipeline();
+	void UpdateParams(IScriptEnvironment* env);
+	void InitTuning();
+	void Tune(__int64 time);
+	template<int RADIUS> void SmoothingSSE2(int thread_id);
+	template<int RADIUS> void SmoothingSSSE3(int thread_id);
+	template<int RADIUS> void SmoothingFloat(int thread_id);
+	void SmoothingFast(int thread_id);
+	void SmoothingWide(int thread_id);
+	void AccumulateStats(const short* srcp, const short* dstp, int x, int y, int thread_id);
+	void MeasureStats();
+	void PublishStats(IScriptEnvironment* env, const FrameStats& s);
+	void StoreDirection(const short* sad, int x, int y);
+	void ClearDirection(int x, int y);
+	void CopyDirection(IScriptEnvironment* env);
+	void NeutralChroma();
+	void Subbands(int thread_id);
+	void ClassifyBlocks(BYTE* flags, int by, int thread_id, bool count);
+	int CountSkippedBlocks();
+	void PlanStrips(bool skip);
+	template<int INPUT, int RESTORE, bool STREAM> void Process(IScriptEnvironment* env);
+	void ProcessFloat(IScriptEnvironment* env);
+	void ProcessFast(IScriptEnvironment* env);
+	void CheckDeviation(IScriptEnvironment* env);
+	void ProcessCopy(IScriptEnvironment* env);
+	void CopyOutsideRegion(IScriptEnvironment* env);
+	void CopyLumaRect(IScriptEnvironment* env, int x, int y, int w, int h);
+	void ProcessVariants(IScriptEnvironment* env);
+	void RestoreLifting();
+	float DetailWeight(int level) const;
+	void LowpassDiff(float* dstp, int y);
+	void ReflectWide(short* p);
+	void HashSource(unsigned __int64 hash[2]);
+	int CacheParams() const;
+	bool CacheLookup(const unsigned __int64 hash[2], IScriptEnvironment* env);
+	void CacheStore(const unsigned __int64 hash[2]);
+	void StartChromaCopy();
+	PVideoFrame ReturnFrame(PVideoFrame frame);
+	const PVideoFrame& SrcFrame() const;
+	const BYTE* SrcLuma() const;
+	BYTE* DstLuma() const;
+	short* OrigApprox() const;
+	void WidenPlane(BYTE* dstp, int dst_pitch, const BYTE* srcp, int src_pitch, int row_size, int height);
 
 public:
-	MosquitoNR(PClip _child, int _strength, int _restore, int _radius, int _threads, IScriptEnvironment* env);
+	MosquitoNR(PClip _child, int _strength, int _restore, int _radius, int _threads, int _stream, int _prefetch,
+		int _semiplanar, int _bits, bool _out16, bool _fast, int _wavelet, int _levels, int _lowpass, int _restore1, int _restore2,
+		int _flat, PClip _mask, int _x, int _y, int _w, int _h,
+		int _cache, bool _incremental, const char* _variants,
+		bool _stats, int _output, bool _runtime, IScriptEnvironment* env);
 	~MosquitoNR();
 	PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
 
 	void CopyLumaFrom();
-	void CopyLumaTo();
-	void Smoothing(int thread_id);
+	template<bool STREAM> void CopyLumaTo();
+	void CopyLumaFrom16();
+	template<bool STREAM> void CopyLumaTo16();
+	template<bool STREAM> void CopyDiff(int thread_id);
+	void CopyLumaFromFloat();
+	void CopyLumaToFloat();
+	void CopyLumaFromFast();
+	void UnpackYUY2(int thread_id);
+	void CopyChroma(int thread_id);
+	template<bool STREAM> void PackYUY2(int thread_id);
 	void WaveletVert1(int thread_id);
 	void WaveletHorz1(int thread_id);
-	void WaveletVert2(int thread_id);
+	template<bool STREAM> void WaveletVert2(int thread_id);
 	void WaveletHorz2(int thread_id);
 	void WaveletHorz3(int thread_id);
+	void BlendMask(int thread_id);
+	void SaveBlur(int thread_id);
+	void SynthesizeVariant(int thread_id);
 	void BlendCoef(int thread_id);
 	void InvWaveletHorz(int thread_id);
 	void InvWaveletVert(int thread_id);
+	template<int LEVEL> void WaveletFloat(int thread_id);
+	template<int LEVEL> void InvWaveletFloat(int thread_id);
+	template<int LEVEL> void DownsampleFast(int thread_id);
+	void UpsampleFast(int thread_id);
+	void RestoreFast(int thread_id);
+	template<int WAVELET> void LiftForwardHorz(int thread_id);
+	template<int WAVELET> void LiftForwardVert(int thread_id);
+	template<int WAVELET> void LiftInverseVert(int thread_id);
+	template<int WAVELET> void LiftInverseHorz(int thread_id);
+	template<bool GAUSS> void LowpassVert(int thread_id);
+	template<bool GAUSS> void LowpassHorz(int thread_id);
 };
 
 #endif	// MOSQUITO_NR_H_
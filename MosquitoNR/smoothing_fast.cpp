@@ -0,0 +1,91 @@
+//------------------------------------------------------------------------------
+//		smoothing_fast.cpp
+//------------------------------------------------------------------------------
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+/*
+	Radius 1 blur of the fast mode, 16 pixels per register in 8-bit lanes.
+	SADs are summed with saturation, and averages are rounded up (pavgb).
+
+	The blurred pixel of SmoothingSSE2 is
+		(coef0 * c + s * (p0 + p1)) / 64 = c + (avg(p0, p1) - c) * s / 32						(direction 0-3)
+		(coef1 * c + s * (p0 + p1 + p2 + p3)) / 128 = c + (avg(p0, p1, p2, p3) - c) * s / 32	(direction 4-7)
+	so only the average of the selected direction is kept, and it is blended once.
+	The blend by s / 32 is done with pavgb for each bit of s (from the lowest one),
+	so the result is rounded up by less than 1.
+*/
+
+static inline __m128i absdiff(__m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+// keep the direction of smaller SAD (the earlier one wins a tie, like the identification number)
+static inline void keep_best(__m128i& best_sad, __m128i& best_avg, __m128i sad, __m128i avg)
+{
+	const __m128i min_sad  = _mm_min_epu8(sad, best_sad);
+	const __m128i not_less = _mm_cmpeq_epi8(min_sad, best_sad);
+	best_avg = _mm_or_si128(_mm_and_si128(not_less, best_avg), _mm_andnot_si128(not_less, avg));
+	best_sad = min_sad;
+}
+
+void MosquitoNR::SmoothingFast(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int width  = this->width;
+	const int pitch  = this->pitch * sizeof(short);
+	const int weight = strength;
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		const BYTE* srcp = reinterpret_cast<BYTE*>(luma[0]) + (y + 2) * pitch + 16;
+		BYTE* dstp = restore == 0 ? DstLuma() + y * dst->GetPitch()
+		                          : reinterpret_cast<BYTE*>(luma[1]) + (y + 2) * pitch + 16;
+
+		for (int x = 0; x < width; x += 16)
+		{
+			const BYTE* p = srcp + x;
+			const __m128i c  = _mm_load_si128 ((const __m128i*)(p));
+			const __m128i l  = _mm_loadu_si128((const __m128i*)(p - 1));
+			const __m128i r  = _mm_loadu_si128((const __m128i*)(p + 1));
+			const __m128i u  = _mm_load_si128 ((const __m128i*)(p - pitch));
+			const __m128i d  = _mm_load_si128 ((const __m128i*)(p + pitch));
+			const __m128i ul = _mm_loadu_si128((const __m128i*)(p - pitch - 1));
+			const __m128i ur = _mm_loadu_si128((const __m128i*)(p - pitch + 1));
+			const __m128i dl = _mm_loadu_si128((const __m128i*)(p + pitch - 1));
+			const __m128i dr = _mm_loadu_si128((const __m128i*)(p + pitch + 1));
+			__m128i a, b;
+
+			// (0)
+			__m128i best_sad = _mm_adds_epu8(absdiff(l, c), absdiff(r, c));
+			__m128i best_avg = _mm_avg_epu8(l, r);
+			// (1) - (3)
+			keep_best(best_sad, best_avg, _mm_adds_epu8(absdiff(ul, c), absdiff(dr, c)), _mm_avg_epu8(ul, dr));
+			keep_best(best_sad, best_avg, _mm_adds_epu8(absdiff(u,  c), absdiff(d,  c)), _mm_avg_epu8(u,  d ));
+			keep_best(best_sad, best_avg, _mm_adds_epu8(absdiff(ur, c), absdiff(dl, c)), _mm_avg_epu8(ur, dl));
+			// (4) - (7)
+			a = _mm_avg_epu8(l,  ul); b = _mm_avg_epu8(r,  dr);
+			keep_best(best_sad, best_avg, _mm_adds_epu8(absdiff(a, c), absdiff(b, c)), _mm_avg_epu8(a, b));
+			a = _mm_avg_epu8(ul, u ); b = _mm_avg_epu8(dr, d );
+			keep_best(best_sad, best_avg, _mm_adds_epu8(absdiff(a, c), absdiff(b, c)), _mm_avg_epu8(a, b));
+			a = _mm_avg_epu8(u,  ur); b = _mm_avg_epu8(d,  dl);
+			keep_best(best_sad, best_avg, _mm_adds_epu8(absdiff(a, c), absdiff(b, c)), _mm_avg_epu8(a, b));
+			a = _mm_avg_epu8(ur, r ); b = _mm_avg_epu8(dl, l );
+			keep_best(best_sad, best_avg, _mm_adds_epu8(absdiff(a, c), absdiff(b, c)), _mm_avg_epu8(a, b));
+
+			// c + (best_avg - c) * strength / 32 (steps below the lowest set bit do nothing)
+			__m128i out = best_avg;
+			if (weight < 32) {
+				out = c;
+				for (int bit = weight & -weight; 0 < bit && bit < 32; bit <<= 1)
+					out = _mm_avg_epu8(out, weight & bit ? best_avg : c);
+			}
+
+			_mm_store_si128((__m128i*)(dstp + x), out);
+		}
+	}
+}
@@ -0,0 +1,131 @@
+//------------------------------------------------------------------------------
+//		smoothing_float.cpp
+//------------------------------------------------------------------------------
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+/*
+	Same blur as SmoothingSSE2 for float input, 4 pixels at a time.
+	All 8 directions are blurred, and the one with the smallest SAD is selected by masks.
+	Ties are resolved in the same order as the "identification number" of the integer version.
+
+	radius = 1
+		0-3: two pixels on a line
+		4-7: two pairs of pixels between the lines (averaged for the SAD)
+	radius = 2
+		0-3: four pixels on a line
+		4-7: two pairs of pixels and two pixels at the far end
+*/
+
+// offsets (x, y) of the neighbors of each direction
+static const int near_pos[8][4][2] = {
+	{ {-1, 0}, { 1, 0} }, { {-1,-1}, { 1, 1} }, { { 0,-1}, { 0, 1} }, { { 1,-1}, {-1, 1} },
+	{ {-1, 0}, {-1,-1}, { 1, 0}, { 1, 1} }, { {-1,-1}, { 0,-1}, { 1, 1}, { 0, 1} },
+	{ { 0,-1}, { 1,-1}, { 0, 1}, {-1, 1} }, { { 1,-1}, { 1, 0}, {-1, 1}, {-1, 0} },
+};
+static const int far_pos[8][2][2] = {
+	{ {-2, 0}, { 2, 0} }, { {-2,-2}, { 2, 2} }, { { 0,-2}, { 0, 2} }, { { 2,-2}, {-2, 2} },
+	{ {-2,-1}, { 2, 1} }, { {-1,-2}, { 1, 2} }, { { 1,-2}, {-1, 2} }, { { 2,-1}, {-2, 1} },
+};
+
+static inline __m128 absdiff(__m128 a, __m128 b, __m128 mask)
+{
+	return _mm_and_ps(_mm_sub_ps(a, b), mask);
+}
+
+// direction-aware blur
+template<int RADIUS>
+void MosquitoNR::SmoothingFloat(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int width = this->width;
+	const int pitch = this->pitch;
+
+	// weights of own pixel and others (divisors of SmoothingSSE2 are folded in)
+	const float div = RADIUS == 1 ? 64.0f : 128.0f;
+	const __m128 own_line = _mm_set1_ps(coef[0] / div);
+	const __m128 own_pair = _mm_set1_ps(coef[1] / (div * 2));
+	const __m128 oth_line = _mm_set1_ps(coef[2] / div);
+	const __m128 oth_pair = _mm_set1_ps(coef[2] / (div * 2));
+	const __m128 oth_far  = _mm_set1_ps(coef[3] / (div * 2));
+	const __m128 half     = _mm_set1_ps(0.5f);
+	const __m128 zero     = _mm_setzero_ps();
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+	int near_ofs[8][4], far_ofs[8][2];
+	for (int d = 0; d < 8; ++d) {
+		for (int i = 0; i < 4; ++i) near_ofs[d][i] = near_pos[d][i][1] * pitch + near_pos[d][i][0];
+		for (int i = 0; i < 2; ++i) far_ofs[d][i]  = far_pos[d][i][1]  * pitch + far_pos[d][i][0];
+	}
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		const float* srcp = fluma[0] + (y + 2) * pitch + 8;
+		float* dstp = fluma[1] + (y + 2) * pitch + 8;
+
+		for (int x = 0; x < width; x += 4, srcp += 4, dstp += 4)
+		{
+			const __m128 c = _mm_load_ps(srcp);
+			__m128 best_sad = zero, best_val = c;
+
+			for (int d = 0; d < 8; ++d)
+			{
+				__m128 sad, sum, val;
+
+				if (d < 4) {
+					const __m128 p0 = _mm_loadu_ps(srcp + near_ofs[d][0]);
+					const __m128 p1 = _mm_loadu_ps(srcp + near_ofs[d][1]);
+					sad = _mm_add_ps(absdiff(p0, c, abs_mask), absdiff(p1, c, abs_mask));
+					sum = _mm_add_ps(p0, p1);
+					if (RADIUS == 2) {
+						const __m128 f0 = _mm_loadu_ps(srcp + far_ofs[d][0]);
+						const __m128 f1 = _mm_loadu_ps(srcp + far_ofs[d][1]);
+						sad = _mm_add_ps(sad, _mm_add_ps(absdiff(f0, c, abs_mask), absdiff(f1, c, abs_mask)));
+						sum = _mm_add_ps(sum, _mm_add_ps(f0, f1));
+					}
+					val = _mm_add_ps(_mm_mul_ps(c, own_line), _mm_mul_ps(sum, oth_line));
+				} else {
+					const __m128 a = _mm_add_ps(_mm_loadu_ps(srcp + near_ofs[d][0]), _mm_loadu_ps(srcp + near_ofs[d][1]));
+					const __m128 b = _mm_add_ps(_mm_loadu_ps(srcp + near_ofs[d][2]), _mm_loadu_ps(srcp + near_ofs[d][3]));
+					sad = _mm_add_ps(absdiff(_mm_mul_ps(a, half), c, abs_mask), absdiff(_mm_mul_ps(b, half), c, abs_mask));
+					val = _mm_add_ps(_mm_mul_ps(c, own_pair), _mm_mul_ps(_mm_add_ps(a, b), oth_pair));
+					if (RADIUS == 2) {
+						const __m128 f0 = _mm_loadu_ps(srcp + far_ofs[d][0]);
+						const __m128 f1 = _mm_loadu_ps(srcp + far_ofs[d][1]);
+						sad = _mm_add_ps(sad, _mm_add_ps(absdiff(f0, c, abs_mask), absdiff(f1, c, abs_mask)));
+						val = _mm_add_ps(val, _mm_mul_ps(_mm_add_ps(f0, f1), oth_far));
+					}
+				}
+
+				if (d == 0) {
+					best_sad = sad;
+					best_val = val;
+				} else {
+					const __m128 less = _mm_cmplt_ps(sad, best_sad);
+					best_sad = _mm_min_ps(sad, best_sad);
+					best_val = _mm_or_ps(_mm_and_ps(less, val), _mm_andnot_ps(less, best_val));
+				}
+			}
+
+			// flat area is left as is
+			const __m128 flat = _mm_cmpeq_ps(best_sad, zero);
+			_mm_store_ps(dstp, _mm_or_ps(_mm_and_ps(flat, c), _mm_andnot_ps(flat, best_val)));
+		}
+	}
+
+	// vertical reflection
+	if (y_start <= 1 && 1 < y_end)
+		memcpy(fluma[1] + pitch, fluma[1] + 3 * pitch, pitch * sizeof(float));
+	if (y_start <= 2 && 2 < y_end)
+		memcpy(fluma[1],         fluma[1] + 4 * pitch, pitch * sizeof(float));
+	if (y_start <= height - 3 && height - 3 < y_end)
+		memcpy(fluma[1] + (height + 3) * pitch, fluma[1] + (height - 1) * pitch, pitch * sizeof(float));
+	if (y_start <= height - 2 && height - 2 < y_end)
+		memcpy(fluma[1] + (height + 2) * pitch, fluma[1] +  height      * pitch, pitch * sizeof(float));
+}
+
+template void MosquitoNR::SmoothingFloat<1>(int thread_id);
+template void MosquitoNR::SmoothingFloat<2>(int thread_id);
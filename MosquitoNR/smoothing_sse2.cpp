@@ -2,6 +2,7 @@
 //		smoothing_sse2.cpp
 //------------------------------------------------------------------------------
 
+#include <emmintrin.h>
 #include "mosquito_nr.h"
 
 #if !defined(_WIN64)
@@ -22,7 +23,198 @@
 #define rbp	rbp
 #endif
 
+// flags of the 8x8 blocks of block row by to be copied instead of blurred (counted if count is true)
+//   1: the range (max - min) is less than flat, including the pixels read by the blur of radius 1 or 2,
+//      or the mask is 0 on all pixels (the source is copied)
+//   2: none of the above, and the pixels read by the blur are the same as the previous frame, which blurred
+//      the block (the previous blur is copied; a block copied from the source then is blurred again)
+void MosquitoNR::ClassifyBlocks(BYTE* flags, int by, int thread_id, bool count)
+{
+	const int pitch = this->pitch;
+	const int blocks = (width + 7) / 8;
+	memset(flags, 0, blocks);
+
+	if (flat > 0)
+	{
+		const int y_begin = by * 8 - radius;
+		const int y_end   = min(by * 8 + 8, height) + radius;
+		const int threshold = flat << 4;		// internal 12-bit precision
+		short* colmax = work[thread_id];
+		short* colmin = colmax + pitch;
+
+		// vertical max/min of each column (including the reflected ones)
+		const short* p = luma[0] + (y_begin + 2) * pitch;
+		for (int x = 0; x < pitch; x += 8) {
+			_mm_store_si128((__m128i*)(colmax + x), _mm_load_si128((const __m128i*)(p + x)));
+			_mm_store_si128((__m128i*)(colmin + x), _mm_load_si128((const __m128i*)(p + x)));
+		}
+		for (int y = y_begin + 1; y < y_end; ++y) {
+			p += pitch;
+			for (int x = 0; x < pitch; x += 8) {
+				const __m128i v = _mm_load_si128((const __m128i*)(p + x));
+				_mm_store_si128((__m128i*)(colmax + x), _mm_max_epi16(_mm_load_si128((const __m128i*)(colmax + x)), v));
+				_mm_store_si128((__m128i*)(colmin + x), _mm_min_epi16(_mm_load_si128((const __m128i*)(colmin + x)), v));
+			}
+		}
+
+		// horizontal max/min of each block
+		colmax += 8, colmin += 8;
+		for (int bx = 0; bx < blocks; ++bx) {
+			int vmax = colmax[bx*8-radius], vmin = colmin[bx*8-radius];
+			for (int x = bx * 8 - radius + 1; x < min(bx * 8 + 8, width) + radius; ++x)
+				vmax = max(vmax, colmax[x]), vmin = min(vmin, colmin[x]);
+			flags[bx] = vmax - vmin < threshold;
+		}
+	}
+
+	if (mask)
+	{
+		// OR of the mask rows of the block row
+		BYTE* cover = reinterpret_cast<BYTE*>(work[thread_id] + 3 * pitch);
+		const int mask_pitch = mask_frame->GetPitch();
+		const BYTE* m = mask_frame->GetReadPtr() + (roi_y + by * 8) * mask_pitch + roi_x;
+		for (int x = 0; x < width; x += 16)
+			_mm_storeu_si128((__m128i*)(cover + x), _mm_setzero_si128());
+		for (int y = by * 8; y < min(by * 8 + 8, height); ++y, m += mask_pitch)
+			for (int x = 0; x < width; x += 16)
+				_mm_storeu_si128((__m128i*)(cover + x), _mm_or_si128(_mm_loadu_si128((const __m128i*)(cover + x)), _mm_loadu_si128((const __m128i*)(m + x))));
+
+		for (int bx = 0; bx < blocks; ++bx) {
+			int covered = 0;
+			for (int x = bx * 8; x < min(bx * 8 + 8, width); ++x) covered |= cover[x];
+			if (!covered) flags[bx] = 1;
+		}
+	}
+
+	if (incremental && prev_valid)
+	{
+		// AND of the equalities of the column (including the reflected ones)
+		const int y_begin = by * 8 - radius;
+		const int y_end   = min(by * 8 + 8, height) + radius;
+		short* same = work[thread_id] + 4 * pitch;
+		const short* p = luma[0]    + (y_begin + 2) * pitch;
+		const short* q = prev_luma + (y_begin + 2) * pitch;
+		for (int x = 0; x < pitch; x += 8)
+			_mm_store_si128((__m128i*)(same + x), _mm_set1_epi16(-1));
+		for (int y = y_begin; y < y_end; ++y, p += pitch, q += pitch)
+			for (int x = 0; x < pitch; x += 8)
+				_mm_store_si128((__m128i*)(same + x), _mm_and_si128(_mm_load_si128((const __m128i*)(same + x)),
+					_mm_cmpeq_epi16(_mm_load_si128((const __m128i*)(p + x)), _mm_load_si128((const __m128i*)(q + x)))));
+
+		same += 8;
+		const BYTE* prev = prev_flags + by * blocks;
+		for (int bx = 0; bx < blocks; ++bx) {
+			if (flags[bx] || prev[bx] == 1) continue;
+			int equal = -1;
+			for (int x = bx * 8 - radius; x < min(bx * 8 + 8, width) + radius; ++x) equal &= same[x];
+			if (equal) flags[bx] = 2;
+		}
+	}
+
+	// for restoring, and what prev_blur holds for the next frame (the block row of 2 threads gets the same
+	// flags from both)
+	memcpy(block_flags + by * blocks, flags, blocks);
+
+	if (count) {
+		for (int bx = 0; bx < blocks; ++bx) {
+			if      (flags[bx] == 1) ++skip_count[thread_id];
+			else if (flags[bx] == 2) ++reuse_count[thread_id];
+		}
+	}
+}
+
+// original + (processed - original) * mask / 255 -> luma[1]
+// (luma[1] is the original on the strips kept by restoring, where the mask is 0 on all blocks around)
+void MosquitoNR::BlendMask(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int mask_pitch = mask_frame->GetPitch();
+	const __m128i c255  = _mm_set1_epi16(255);
+	const __m128 scale = _mm_set1_ps(1.0f / 255);
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		if (strip_action[y / 8] == STRIP_KEEP) continue;
+		const short* p = luma[0] + (y + 2) * pitch + 8;
+		short* q = luma[1] + (y + 2) * pitch + 8;
+		const BYTE* m = mask_frame->GetReadPtr() + (roi_y + y) * mask_pitch + roi_x;
+
+		for (int x = 0; x < width; x += 8) {
+			const __m128i w  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(m + x)), _mm_setzero_si128());
+			const __m128i iw = _mm_sub_epi16(c255, w);
+			const __m128i a  = _mm_load_si128((const __m128i*)(p + x));
+			const __m128i b  = _mm_load_si128((const __m128i*)(q + x));
+			const __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), _mm_unpacklo_epi16(iw, w));
+			const __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), _mm_unpackhi_epi16(iw, w));
+			_mm_store_si128((__m128i*)(q + x), _mm_packs_epi32(
+				_mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), scale)),
+				_mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), scale))));
+		}
+	}
+}
+
+// statistics of 8 pixels at (x, y): original srcp, blurred dstp
+//   stat_correction : sum of |blurred - original|
+//   stat_detail     : sum of the squared level-1 detail coefficients of CDF 5/3 (odd columns and odd rows)
+//   changed_map     : blocks with any change
+void MosquitoNR::AccumulateStats(const short* srcp, const short* dstp, int x, int y, int thread_id)
+{
+	const __m128i c = _mm_load_si128((const __m128i*)srcp);
+	const __m128i d = _mm_sub_epi16(_mm_load_si128((const __m128i*)dstp), c);
+	__m128i valid = _mm_set1_epi16(-1);
+	if (x + 8 > width) {
+		const __m128i lane = _mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0);
+		valid = _mm_cmplt_epi16(lane, _mm_set1_epi16(width - x));
+	}
+
+	// |blurred - original|
+	const __m128i ad = _mm_and_si128(_mm_max_epi16(d, _mm_sub_epi16(_mm_setzero_si128(), d)), valid);
+	__m128i sum = _mm_madd_epi16(ad, _mm_set1_epi16(1));
+
+	// horizontal detail of odd columns, and vertical detail of odd rows
+	const __m128i odd = _mm_and_si128(_mm_set1_epi32((int)0xffff0000), valid);
+	__m128i h = _mm_sub_epi16(c, _mm_srai_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(srcp - 1)), _mm_loadu_si128((const __m128i*)(srcp + 1))), 1));
+	h = _mm_and_si128(h, odd);
+	__m128i energy = _mm_madd_epi16(h, h);
+	if (y & 1) {
+		__m128i v = _mm_sub_epi16(c, _mm_srai_epi16(_mm_add_epi16(_mm_load_si128((const __m128i*)(srcp - pitch)), _mm_load_si128((const __m128i*)(srcp + pitch))), 1));
+		v = _mm_and_si128(v, valid);
+		energy = _mm_add_epi32(energy, _mm_madd_epi16(v, v));
+	}
+
+	__declspec(align(16)) int s[4], e[4];
+	_mm_store_si128((__m128i*)s, sum);
+	_mm_store_si128((__m128i*)e, energy);
+	stat_correction[thread_id] += s[0] + s[1] + s[2] + s[3];
+	stat_detail[thread_id]     += (__int64)e[0] + e[1] + e[2] + e[3];
+	if (_mm_movemask_epi8(_mm_cmpeq_epi16(ad, _mm_setzero_si128())) != 0xffff)
+		changed_map[y / 8 * ((width + 7) / 8) + x / 8] = 1;
+}
+
+// selected directions of 8 pixels at (x, y) -> direction_map
+// (identification number, and the minimum SAD in 8-bit units saturated at 255 in the map below)
+void MosquitoNR::StoreDirection(const short* sad, int x, int y)
+{
+	const __m128i v   = _mm_load_si128((const __m128i*)sad);
+	const __m128i id  = _mm_and_si128(v, _mm_set1_epi16(7));
+	const __m128i min = _mm_srli_epi16(v, 4);	// (v &~ 7) >> 4
+	BYTE* p = direction_map + y * direction_pitch + x;
+	_mm_storel_epi64((__m128i*)p, _mm_packus_epi16(id, id));
+	_mm_storel_epi64((__m128i*)(p + height * direction_pitch), _mm_packus_epi16(min, min));
+}
+
+// pixels of a skipped block at (x, y) -> direction_map (direction 0 and SAD 0)
+void MosquitoNR::ClearDirection(int x, int y)
+{
+	BYTE* p = direction_map + y * direction_pitch + x;
+	memset(p, 0, 8);
+	memset(p + height * direction_pitch, 0, 8);
+}
+
 // direction-aware blur
+template<int RADIUS>
 void MosquitoNR::SmoothingSSE2(int thread_id)
 {
 	const int y_start = height *  thread_id      / threads;
@@ -31,24 +223,42 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 	const int width  = this->width;
 	const int pitch  = this->pitch;
 	const int pitch2 = pitch * sizeof(short);
-	__declspec(align(16)) short sad[48], tmp[24];
+	__declspec(align(16)) short sad[48], tmp[40];
 	short *srcp, *dstp, *sadp = sad, *tmpp = tmp;
+	BYTE* flags = reinterpret_cast<BYTE*>(work[thread_id] + 2 * pitch);
+	skip_count[thread_id] = reuse_count[thread_id] = 0;
+	stat_correction[thread_id] = stat_detail[thread_id] = 0;
 	for (int i =  8; i < 16; ++i) tmp[i] = 4;
 	for (int i = 16; i < 24; ++i) tmp[i] = 3;
+	for (int i = 24; i < 32; ++i) tmp[i] = 32760 >> sad_shift;	// limit of the SADs (saturated)
+	for (int i = 32; i < 40; ++i) tmp[i] = 0;
+	tmp[32] = sad_shift;
 
-	if (radius == 1)
+	if (RADIUS == 1)
 	{
-		const int coef0 =  64 - strength * 2;	// own pixel's coefficient (when divisor = 64)
-		const int coef1 = 128 - strength * 4;	// own pixel's coefficient (when divisor = 128)
-		const int coef2 = strength;				// other pixel's coefficient
+		const int coef0 = coef[0];	// own pixel's coefficient (when divisor = 64)
+		const int coef1 = coef[1];	// own pixel's coefficient (when divisor = 128)
+		const int coef2 = coef[2];	// other pixel's coefficient
 
 		for (int y = y_start; y < y_end; ++y)
 		{
 			srcp = luma[0] + (y + 2) * pitch + 8;
 			dstp = luma[1] + (y + 2) * pitch + 8;
 
+			// skipped blocks are classified on the first row of each block row (counted by the thread owning it)
+			if (skip_blocks && (y == y_start || y % 8 == 0))
+				ClassifyBlocks(flags, y / 8, thread_id, y % 8 == 0);
+
 			for (int x = 0; x < width; x += 8)
 			{
+				if (skip_blocks && flags[x / 8]) {
+					memcpy(dstp, flags[x / 8] == 2 ? prev_blur + (dstp - luma[1]) : srcp, 8 * sizeof(short));
+					if (stats) AccumulateStats(srcp, dstp, x, y, thread_id);
+					if (direction_map) ClearDirection(x, y);
+					srcp += 8, dstp += 8;
+					continue;
+				}
+
 				// to compute an absolute value of xmm0, following code is used:
 				//		pxor	xmm1, xmm1
 				//		psubw	xmm1, xmm0
@@ -79,6 +289,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					psubw		xmm6, xmm1
 					pmaxsw		xmm1, xmm6
 					paddw		xmm0, xmm1
+					pminsw		xmm0, [rdx+48]			// saturate and scale up the SAD to make the lower 3 bits 0
+					psllw		xmm0, [rdx+64]			// (for high bit-depth input)
 					movdqa		[rdi], xmm0
 
 					movdqa		xmm0, [rsi]				// xmm0 = (  0, -1 )
@@ -98,9 +310,11 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					pmaxsw		xmm5, xmm6
 					movdqa		xmm6, [rdx+16]
 					paddw		xmm4, xmm5
+					pminsw		xmm4, [rdx+48]
+					psllw		xmm4, [rdx+64]
 					paddw		xmm4, xmm6				// add "identification number" to the lower 3 bits (4)
-					psubw		xmm6, [rdx+32]			// (The lower 3 bits are always zero.
-					movdqa		[rdi+16], xmm4			//  If input is 9-bit or more, this hack doesn't work)
+					psubw		xmm6, [rdx+32]			// (The lower 3 bits are 0 after the shift.
+					movdqa		[rdi+16], xmm4			//  SADs above the limit compare equal)
 					movdqa		[rdx], xmm6
 
 					movdqa		xmm4, xmm2
@@ -115,6 +329,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					pmaxsw		xmm3, xmm6
 					movdqa		xmm6, [rdx]
 					paddw		xmm2, xmm3
+					pminsw		xmm2, [rdx+48]
+					psllw		xmm2, [rdx+64]
 					paddw		xmm2, xmm6				// (1)
 					paddw		xmm6, [rdx+16]
 					movdqa		[rdi+32], xmm2
@@ -137,6 +353,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					pmaxsw		xmm5, xmm6
 					movdqa		xmm6, [rdx]
 					paddw		xmm4, xmm5
+					pminsw		xmm4, [rdx+48]
+					psllw		xmm4, [rdx+64]
 					paddw		xmm4, xmm6				// (5)
 					psubw		xmm6, [rdx+32]
 					movdqa		[rdi+48], xmm4
@@ -154,6 +372,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					pmaxsw		xmm1, xmm6
 					movdqa		xmm6, [rdx]
 					paddw		xmm0, xmm1
+					pminsw		xmm0, [rdx+48]
+					psllw		xmm0, [rdx+64]
 					paddw		xmm0, xmm6				// (2)
 					paddw		xmm6, [rdx+16]
 					movdqa		[rdi+64], xmm0
@@ -176,6 +396,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					pmaxsw		xmm5, xmm6
 					movdqa		xmm6, [rdx]
 					paddw		xmm4, xmm5
+					pminsw		xmm4, [rdx+48]
+					psllw		xmm4, [rdx+64]
 					paddw		xmm4, xmm6				// (6)
 					psubw		xmm6, [rdx+32]
 
@@ -196,6 +418,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					psubw		xmm5, xmm3
 					pmaxsw		xmm3, xmm5
 					paddw		xmm2, xmm3
+					pminsw		xmm2, [rdx+48]
+					psllw		xmm2, [rdx+64]
 					paddw		xmm2, xmm6				// (3)
 					paddw		xmm6, [rdx+16]
 
@@ -210,6 +434,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					pmaxsw		xmm0, xmm3
 					pmaxsw		xmm1, xmm5
 					paddw		xmm0, xmm1
+					pminsw		xmm0, [rdx+48]
+					psllw		xmm0, [rdx+64]
 					paddw		xmm0, xmm6				// (7)
 
 					pminsw		xmm4, xmm2
@@ -241,23 +467,41 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 							*dstp = (coef1 * srcp[0] + coef2 * (srcp[-pitch+1] + srcp[1]      + srcp[-1]    + srcp[pitch-1]) + 64) >> 7; break;
 					}
 				}
+
+				if (stats) AccumulateStats(srcp - 8, dstp - 8, x, y, thread_id);
+				if (direction_map) StoreDirection(sad, x, y);
 			}
+
+			// blurred row is kept for the unchanged blocks of the next frame
+			if (incremental) memcpy(prev_blur + (y + 2) * pitch + 8, luma[1] + (y + 2) * pitch + 8, width * sizeof(short));
 		}
 	}
-	else	// radius == 2
+	else	// RADIUS == 2
 	{
-		const int coef0 = 128 - strength * 4;	// own pixel's coefficient (when divisor = 128)
-		const int coef1 = 256 - strength * 8;	// own pixel's coefficient (when divisor = 256)
-		const int coef2 = strength;				// other pixel's coefficient
-		const int coef3 = strength * 2;			// other pixel's coefficient (doubled)
+		const int coef0 = coef[0];	// own pixel's coefficient (when divisor = 128)
+		const int coef1 = coef[1];	// own pixel's coefficient (when divisor = 256)
+		const int coef2 = coef[2];	// other pixel's coefficient
+		const int coef3 = coef[3];	// other pixel's coefficient (doubled)
 
 		for (int y = y_start; y < y_end; ++y)
 		{
 			srcp = luma[0] + (y + 2) * pitch + 8;
 			dstp = luma[1] + (y + 2) * pitch + 8;
 
+			// skipped blocks are classified on the first row of each block row (counted by the thread owning it)
+			if (skip_blocks && (y == y_start || y % 8 == 0))
+				ClassifyBlocks(flags, y / 8, thread_id, y % 8 == 0);
+
 			for (int x = 0; x < width; x += 8)
 			{
+				if (skip_blocks && flags[x / 8]) {
+					memcpy(dstp, flags[x / 8] == 2 ? prev_blur + (dstp - luma[1]) : srcp, 8 * sizeof(short));
+					if (stats) AccumulateStats(srcp, dstp, x, y, thread_id);
+					if (direction_map) ClearDirection(x, y);
+					srcp += 8, dstp += 8;
+					continue;
+				}
+
 				__asm
 				{
 					mov			rsi, srcp
@@ -294,6 +538,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					paddw		xmm0, xmm1
 					paddw		xmm2, xmm3
 					paddw		xmm0, xmm2
+					pminsw		xmm0, [rdx+48]			// saturate and scale up the SAD to make the lower 3 bits 0
+					psllw		xmm0, [rdx+64]			// (for high bit-depth input)
 					movdqa		[rdi], xmm0
 
 					movdqu		xmm0, [rsi+rax-2]		// xmm0 = ( -1, -1 )
@@ -324,6 +570,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					paddw		xmm2, xmm3
 					paddw		xmm4, xmm5
 					paddw		xmm2, xmm4
+					pminsw		xmm2, [rdx+48]
+					psllw		xmm2, [rdx+64]
 					paddw		xmm2, xmm6				// add "identification number" to the lower 3 bits (4)
 					psubw		xmm6, [rdx+32]
 					movdqa		[rdi+16], xmm2
@@ -353,6 +601,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					paddw		xmm0, xmm1
 					paddw		xmm2, xmm3
 					paddw		xmm0, xmm2
+					pminsw		xmm0, [rdx+48]
+					psllw		xmm0, [rdx+64]
 					paddw		xmm0, xmm6				// (1)
 					paddw		xmm6, [rdx+16]
 					movdqa		[rdi+32], xmm0
@@ -386,6 +636,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					paddw		xmm2, xmm3
 					paddw		xmm4, xmm5
 					paddw		xmm2, xmm4
+					pminsw		xmm2, [rdx+48]
+					psllw		xmm2, [rdx+64]
 					paddw		xmm2, xmm6				// (5)
 					psubw		xmm6, [rdx+32]
 					movdqa		[rdi+48], xmm2
@@ -415,6 +667,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					paddw		xmm0, xmm1
 					paddw		xmm2, xmm3
 					paddw		xmm0, xmm2
+					pminsw		xmm0, [rdx+48]
+					psllw		xmm0, [rdx+64]
 					paddw		xmm0, xmm6				// (2)
 					paddw		xmm6, [rdx+16]
 					movdqa		[rdi+64], xmm0
@@ -448,6 +702,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					paddw		xmm2, xmm3
 					paddw		xmm4, xmm5
 					paddw		xmm2, xmm4
+					pminsw		xmm2, [rdx+48]
+					psllw		xmm2, [rdx+64]
 					paddw		xmm2, xmm6				// (6)
 					psubw		xmm6, [rdx+32]
 					movdqa		[rdi+80], xmm2
@@ -477,6 +733,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					paddw		xmm0, xmm1
 					paddw		xmm2, xmm3
 					paddw		xmm0, xmm2
+					pminsw		xmm0, [rdx+48]
+					psllw		xmm0, [rdx+64]
 					paddw		xmm0, xmm6				// (3)
 					paddw		xmm6, [rdx+16]
 					movdqa		[rdx], xmm6
@@ -516,6 +774,8 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 					paddw		xmm2, xmm3
 					paddw		xmm4, xmm5
 					paddw		xmm2, xmm4
+					pminsw		xmm2, [rdx+48]
+					psllw		xmm2, [rdx+64]
 					paddw		xmm2, xmm6				// (7)
 
 					pminsw		xmm0, xmm2
@@ -546,7 +806,13 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 							*dstp = (coef1 * srcp[0] + coef3 * (srcp[-pitch +2] + srcp[pitch -2]) + coef2 * (srcp[-pitch+1] + srcp[1]      + srcp[-1]    + srcp[pitch-1]) + 128) >> 8; break;
 					}
 				}
+
+				if (stats) AccumulateStats(srcp - 8, dstp - 8, x, y, thread_id);
+				if (direction_map) StoreDirection(sad, x, y);
 			}
+
+			// blurred row is kept for the unchanged blocks of the next frame
+			if (incremental) memcpy(prev_blur + (y + 2) * pitch + 8, luma[1] + (y + 2) * pitch + 8, width * sizeof(short));
 		}
 	}
 
@@ -560,3 +826,6 @@ void MosquitoNR::SmoothingSSE2(int thread_id)
 	if (y_start <= height - 2 && height - 2 < y_end)
 		memcpy(luma[1] + (height + 2) * pitch, luma[1] +  height      * pitch, pitch * sizeof(short));
 }
+
+template void MosquitoNR::SmoothingSSE2<1>(int thread_id);
+template void MosquitoNR::SmoothingSSE2<2>(int thread_id);
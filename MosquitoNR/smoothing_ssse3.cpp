@@ -23,6 +23,7 @@
 #endif
 
 // direction-aware blur
+template<int RADIUS>
 void MosquitoNR::SmoothingSSSE3(int thread_id)
 {
 	const int y_start = height *  thread_id      / threads;
@@ -31,24 +32,42 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 	const int width  = this->width;
 	const int pitch  = this->pitch;
 	const int pitch2 = pitch * sizeof(short);
-	__declspec(align(16)) short sad[48], tmp[16];
+	__declspec(align(16)) short sad[48], tmp[32];
 	short *srcp, *dstp, *sadp = sad, *tmpp = tmp;
+	BYTE* flags = reinterpret_cast<BYTE*>(work[thread_id] + 2 * pitch);
+	skip_count[thread_id] = reuse_count[thread_id] = 0;
+	stat_correction[thread_id] = stat_detail[thread_id] = 0;
 	for (int i = 0; i <  8; ++i) tmp[i] = 4;
 	for (int i = 8; i < 16; ++i) tmp[i] = 3;
+	for (int i = 16; i < 24; ++i) tmp[i] = 32760 >> sad_shift;	// limit of the SADs (saturated)
+	for (int i = 24; i < 32; ++i) tmp[i] = 0;
+	tmp[24] = sad_shift;
 
-	if (radius == 1)
+	if (RADIUS == 1)
 	{
-		const int coef0 =  64 - strength * 2;	// own pixel's coefficient (when divisor = 64)
-		const int coef1 = 128 - strength * 4;	// own pixel's coefficient (when divisor = 128)
-		const int coef2 = strength;				// other pixel's coefficient
+		const int coef0 = coef[0];	// own pixel's coefficient (when divisor = 64)
+		const int coef1 = coef[1];	// own pixel's coefficient (when divisor = 128)
+		const int coef2 = coef[2];	// other pixel's coefficient
 
 		for (int y = y_start; y < y_end; ++y)
 		{
 			srcp = luma[0] + (y + 2) * pitch + 8;
 			dstp = luma[1] + (y + 2) * pitch + 8;
 
+			// skipped blocks are classified on the first row of each block row (counted by the thread owning it)
+			if (skip_blocks && (y == y_start || y % 8 == 0))
+				ClassifyBlocks(flags, y / 8, thread_id, y % 8 == 0);
+
 			for (int x = 0; x < width; x += 8)
 			{
+				if (skip_blocks && flags[x / 8]) {
+					memcpy(dstp, flags[x / 8] == 2 ? prev_blur + (dstp - luma[1]) : srcp, 8 * sizeof(short));
+					if (stats) AccumulateStats(srcp, dstp, x, y, thread_id);
+					if (direction_map) ClearDirection(x, y);
+					srcp += 8, dstp += 8;
+					continue;
+				}
+
 				__asm
 				{
 					mov			rsi, srcp
@@ -71,6 +90,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					pabsw		xmm0, xmm0
 					pabsw		xmm1, xmm1
 					paddw		xmm0, xmm1
+					pminsw		xmm0, [rdx+32]			// saturate and scale up the SAD to make the lower 3 bits 0
+					psllw		xmm0, [rdx+48]			// (for high bit-depth input)
 					movdqa		[rdi], xmm0
 
 					movdqa		xmm0, [rsi]				// xmm0 = (  0, -1 )
@@ -85,9 +106,11 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					pabsw		xmm4, xmm4
 					pabsw		xmm5, xmm5
 					paddw		xmm4, xmm5
+					pminsw		xmm4, [rdx+32]
+					psllw		xmm4, [rdx+48]
 					paddw		xmm4, xmm6				// add "identification number" to the lower 3 bits (4)
-					psubw		xmm6, [rdx+16]			// (The lower 3 bits are always zero.
-					movdqa		[rdi+16], xmm4			//  If input is 9-bit or more, this hack doesn't work)
+					psubw		xmm6, [rdx+16]			// (The lower 3 bits are 0 after the shift.
+					movdqa		[rdi+16], xmm4			//  SADs above the limit compare equal)
 
 					movdqa		xmm4, xmm2
 					movdqa		xmm5, xmm3
@@ -96,6 +119,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					pabsw		xmm2, xmm2
 					pabsw		xmm3, xmm3
 					paddw		xmm2, xmm3
+					pminsw		xmm2, [rdx+32]
+					psllw		xmm2, [rdx+48]
 					paddw		xmm2, xmm6				// (1)
 					paddw		xmm6, [rdx]
 					movdqa		[rdi+32], xmm2
@@ -112,6 +137,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					pabsw		xmm4, xmm4
 					pabsw		xmm5, xmm5
 					paddw		xmm4, xmm5
+					pminsw		xmm4, [rdx+32]
+					psllw		xmm4, [rdx+48]
 					paddw		xmm4, xmm6				// (5)
 					psubw		xmm6, [rdx+16]
 					movdqa		[rdi+48], xmm4
@@ -123,6 +150,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					pabsw		xmm0, xmm0
 					pabsw		xmm1, xmm1
 					paddw		xmm0, xmm1
+					pminsw		xmm0, [rdx+32]
+					psllw		xmm0, [rdx+48]
 					paddw		xmm0, xmm6				// (2)
 					paddw		xmm6, [rdx]
 					movdqa		[rdi+64], xmm0
@@ -139,6 +168,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					pabsw		xmm4, xmm4
 					pabsw		xmm5, xmm5
 					paddw		xmm4, xmm5
+					pminsw		xmm4, [rdx+32]
+					psllw		xmm4, [rdx+48]
 					paddw		xmm4, xmm6				// (6)
 					psubw		xmm6, [rdx+16]
 
@@ -155,6 +186,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					pabsw		xmm2, xmm2
 					pabsw		xmm3, xmm3
 					paddw		xmm2, xmm3
+					pminsw		xmm2, [rdx+32]
+					psllw		xmm2, [rdx+48]
 					paddw		xmm2, xmm6				// (3)
 					paddw		xmm6, [rdx]
 
@@ -165,6 +198,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					pabsw		xmm0, xmm0
 					pabsw		xmm1, xmm1
 					paddw		xmm0, xmm1
+					pminsw		xmm0, [rdx+32]
+					psllw		xmm0, [rdx+48]
 					paddw		xmm0, xmm6				// (7)
 
 					pminsw		xmm4, xmm2
@@ -196,23 +231,41 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 							*dstp = (coef1 * srcp[0] + coef2 * (srcp[-pitch+1] + srcp[1]      + srcp[-1]    + srcp[pitch-1]) + 64) >> 7; break;
 					}
 				}
+
+				if (stats) AccumulateStats(srcp - 8, dstp - 8, x, y, thread_id);
+				if (direction_map) StoreDirection(sad, x, y);
 			}
+
+			// blurred row is kept for the unchanged blocks of the next frame
+			if (incremental) memcpy(prev_blur + (y + 2) * pitch + 8, luma[1] + (y + 2) * pitch + 8, width * sizeof(short));
 		}
 	}
-	else	// radius == 2
+	else	// RADIUS == 2
 	{
-		const int coef0 = 128 - strength * 4;	// own pixel's coefficient (when divisor = 128)
-		const int coef1 = 256 - strength * 8;	// own pixel's coefficient (when divisor = 256)
-		const int coef2 = strength;				// other pixel's coefficient
-		const int coef3 = strength * 2;			// other pixel's coefficient (doubled)
+		const int coef0 = coef[0];	// own pixel's coefficient (when divisor = 128)
+		const int coef1 = coef[1];	// own pixel's coefficient (when divisor = 256)
+		const int coef2 = coef[2];	// other pixel's coefficient
+		const int coef3 = coef[3];	// other pixel's coefficient (doubled)
 
 		for (int y = y_start; y < y_end; ++y)
 		{
 			srcp = luma[0] + (y + 2) * pitch + 8;
 			dstp = luma[1] + (y + 2) * pitch + 8;
 
+			// skipped blocks are classified on the first row of each block row (counted by the thread owning it)
+			if (skip_blocks && (y == y_start || y % 8 == 0))
+				ClassifyBlocks(flags, y / 8, thread_id, y % 8 == 0);
+
 			for (int x = 0; x < width; x += 8)
 			{
+				if (skip_blocks && flags[x / 8]) {
+					memcpy(dstp, flags[x / 8] == 2 ? prev_blur + (dstp - luma[1]) : srcp, 8 * sizeof(short));
+					if (stats) AccumulateStats(srcp, dstp, x, y, thread_id);
+					if (direction_map) ClearDirection(x, y);
+					srcp += 8, dstp += 8;
+					continue;
+				}
+
 				__asm
 				{
 					mov			rsi, srcp
@@ -242,6 +295,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					paddw		xmm0, xmm1
 					paddw		xmm2, xmm3
 					paddw		xmm0, xmm2
+					pminsw		xmm0, [rdx+32]			// saturate and scale up the SAD to make the lower 3 bits 0
+					psllw		xmm0, [rdx+48]			// (for high bit-depth input)
 					movdqa		[rdi], xmm0
 
 					movdqu		xmm0, [rsi+rax-2]		// xmm0 = ( -1, -1 )
@@ -263,6 +318,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					paddw		xmm2, xmm3
 					paddw		xmm4, xmm5
 					paddw		xmm2, xmm4
+					pminsw		xmm2, [rdx+32]
+					psllw		xmm2, [rdx+48]
 					paddw		xmm2, xmm6				// add "identification number" to the lower 3 bits (4)
 					psubw		xmm6, [rdx+16]
 					movdqa		[rdi+16], xmm2
@@ -282,6 +339,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					paddw		xmm0, xmm1
 					paddw		xmm2, xmm3
 					paddw		xmm0, xmm2
+					pminsw		xmm0, [rdx+32]
+					psllw		xmm0, [rdx+48]
 					paddw		xmm0, xmm6				// (1)
 					paddw		xmm6, [rdx]
 					movdqa		[rdi+32], xmm0
@@ -305,6 +364,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					paddw		xmm2, xmm3
 					paddw		xmm4, xmm5
 					paddw		xmm2, xmm4
+					pminsw		xmm2, [rdx+32]
+					psllw		xmm2, [rdx+48]
 					paddw		xmm2, xmm6				// (5)
 					psubw		xmm6, [rdx+16]
 					movdqa		[rdi+48], xmm2
@@ -324,6 +385,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					paddw		xmm0, xmm1
 					paddw		xmm2, xmm3
 					paddw		xmm0, xmm2
+					pminsw		xmm0, [rdx+32]
+					psllw		xmm0, [rdx+48]
 					paddw		xmm0, xmm6				// (2)
 					paddw		xmm6, [rdx]
 					movdqa		[rdi+64], xmm0
@@ -347,6 +410,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					paddw		xmm2, xmm3
 					paddw		xmm4, xmm5
 					paddw		xmm2, xmm4
+					pminsw		xmm2, [rdx+32]
+					psllw		xmm2, [rdx+48]
 					paddw		xmm2, xmm6				// (6)
 					psubw		xmm6, [rdx+16]
 					movdqa		[rdi+80], xmm2
@@ -366,6 +431,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					paddw		xmm0, xmm1
 					paddw		xmm2, xmm3
 					paddw		xmm0, xmm2
+					pminsw		xmm0, [rdx+32]
+					psllw		xmm0, [rdx+48]
 					paddw		xmm0, xmm6				// (3)
 					paddw		xmm6, [rdx]
 
@@ -395,6 +462,8 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 					paddw		xmm2, xmm3
 					paddw		xmm4, xmm5
 					paddw		xmm2, xmm4
+					pminsw		xmm2, [rdx+32]
+					psllw		xmm2, [rdx+48]
 					paddw		xmm2, xmm6				// (7)
 
 					pminsw		xmm0, xmm2
@@ -425,7 +494,13 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 							*dstp = (coef1 * srcp[0] + coef3 * (srcp[-pitch +2] + srcp[pitch -2]) + coef2 * (srcp[-pitch+1] + srcp[1]      + srcp[-1]    + srcp[pitch-1]) + 128) >> 8; break;
 					}
 				}
+
+				if (stats) AccumulateStats(srcp - 8, dstp - 8, x, y, thread_id);
+				if (direction_map) StoreDirection(sad, x, y);
 			}
+
+			// blurred row is kept for the unchanged blocks of the next frame
+			if (incremental) memcpy(prev_blur + (y + 2) * pitch + 8, luma[1] + (y + 2) * pitch + 8, width * sizeof(short));
 		}
 	}
 
@@ -439,3 +514,6 @@ void MosquitoNR::SmoothingSSSE3(int thread_id)
 	if (y_start <= height - 2 && height - 2 < y_end)
 		memcpy(luma[1] + (height + 2) * pitch, luma[1] +  height      * pitch, pitch * sizeof(short));
 }
+
+template void MosquitoNR::SmoothingSSSE3<1>(int thread_id);
+template void MosquitoNR::SmoothingSSSE3<2>(int thread_id);
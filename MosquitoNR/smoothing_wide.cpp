@@ -0,0 +1,185 @@
+//------------------------------------------------------------------------------
+//		smoothing_wide.cpp
+//------------------------------------------------------------------------------
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+/*
+	Blur of radius 3-8, 4 pixels at a time.
+
+	Each direction is a line through the pixel with the step (dx, dy), and n steps are taken to both sides.
+		0-3: (1, 0), (1, 1), (0, 1), (-1, 1)	n = radius
+		4-7: (2, 1), (1, 2), (-1, 2), (-2, 1)	n = (radius + 1) / 2
+	Instead of the SAD to the own pixel, the variation along the line (sum of the absolute differences
+	of neighboring samples) is compared, averaged per step. The blurred pixel is
+		c + (average of the 2n samples except own one - c) * strength / 32
+	which is the same weighting as radius 1 and 2.
+
+	Both sums are kept for every line, and moved by one step when the next row is processed
+	(one sample is added and one is removed), so the cost per pixel does not depend on radius.
+	Pixels at the left/right end, whose previous pixel on the line is outside, and the first rows
+	of each thread are summed directly.
+
+	buffers
+		luma[0] : original (8 pixels of horizontal reflection, vertical reflection by row index)
+		wide    : [direction][row parity][sum of samples, variation], wide_pitch ints each
+*/
+
+// step of each direction
+static const int dir_step[8][2] = {
+	{ 1, 0}, { 1, 1}, { 0, 1}, {-1, 1}, { 2, 1}, { 1, 2}, {-1, 2}, {-2, 1},
+};
+
+static inline int reflect(int y, int height)
+{
+	return y < 0 ? -y : y >= height ? 2 * height - 2 - y : y;
+}
+
+// 4 samples as 16-bit lanes
+static inline __m128i load4(const short* p)
+{
+	return _mm_loadl_epi64((const __m128i*)p);
+}
+
+// sign extension of the low 4 lanes to 32 bits
+static inline __m128i widen4(__m128i v)
+{
+	return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
+
+static inline __m128i absdiff4(__m128i a, __m128i b)
+{
+	const __m128i d = _mm_sub_epi16(a, b);
+	return _mm_max_epi16(d, _mm_sub_epi16(_mm_setzero_si128(), d));
+}
+
+void MosquitoNR::SmoothingWide(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int width  = this->width;
+	const int height = this->height;
+	const int pitch  = this->pitch;
+	const int band   = y_end - y_start;
+	const int loop_w = (width + 3) &~ 3;
+	const short* src = luma[0] + 2 * pitch + 8;
+	int* acc = wide[thread_id];
+
+	int n[8];
+	__m128 step_weight[8], blur_weight[8], own_count[8];
+	for (int d = 0; d < 8; ++d) {
+		n[d] = d < 4 ? radius : (radius + 1) / 2;
+		step_weight[d] = _mm_set1_ps(1.0f / (2 * n[d]));
+		blur_weight[d] = _mm_set1_ps(strength / (64.0f * n[d]));
+		own_count[d]   = _mm_set1_ps(2.0f * n[d] + 1.0f);
+	}
+
+#define ROW(yy) (src + reflect(yy, height) * pitch)
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		const short* c_row = ROW(y);
+		int* sum[8];
+		int* var[8];
+
+		// direction 0: slide along the row
+		{
+			const int r = n[0];
+			sum[0] = acc;
+			var[0] = acc + wide_pitch;
+			int s = 0, v = 0;
+			for (int k = -r; k <= r; ++k) s += c_row[k];
+			for (int k = -r; k <  r; ++k) v += abs(c_row[k+1] - c_row[k]);
+			sum[0][0] = s, var[0][0] = v;
+			for (int x = 1; x < loop_w; ++x) {
+				s += c_row[x+r] - c_row[x-r-1];
+				v += abs(c_row[x+r] - c_row[x+r-1]) - abs(c_row[x-r] - c_row[x-r-1]);
+				sum[0][x] = s, var[0][x] = v;
+			}
+		}
+
+		// direction 1-7: move the sums of each line by one step
+		for (int d = 1; d < 8; ++d)
+		{
+			const int dx = dir_step[d][0], dy = dir_step[d][1], r = n[d];
+			const int k = (y - y_start) / dy, parity = (y - y_start) % dy;
+			sum[d] = acc + (d * 2 + parity) * 2 * wide_pitch + 4 + (dx > 0 ? dx * ((band - 1) / dy - k) : -dx * k);
+			var[d] = sum[d] + wide_pitch;
+
+			int x_begin = 0, x_end = 0;		// pixels to be summed directly
+			if (y - y_start < dy) {
+				x_end = loop_w;
+			} else {
+				if (dx > 0) x_end = dx;
+				else        x_begin = width + dx, x_end = width;
+
+				const short* add  = ROW(y +  r      * dy) +  r      * dx;
+				const short* add1 = ROW(y + (r - 1) * dy) + (r - 1) * dx;
+				const short* rem  = ROW(y - (r + 1) * dy) - (r + 1) * dx;
+				const short* rem1 = ROW(y -  r      * dy) -  r      * dx;
+				for (int x = 0; x < loop_w; x += 4) {
+					const __m128i a  = load4(add  + x);
+					const __m128i a1 = load4(add1 + x);
+					const __m128i b  = load4(rem  + x);
+					const __m128i b1 = load4(rem1 + x);
+					const __m128i ds = widen4(_mm_sub_epi16(a, b));
+					const __m128i dv = widen4(_mm_sub_epi16(absdiff4(a, a1), absdiff4(b1, b)));
+					_mm_storeu_si128((__m128i*)(sum[d] + x), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(sum[d] + x)), ds));
+					_mm_storeu_si128((__m128i*)(var[d] + x), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(var[d] + x)), dv));
+				}
+			}
+
+			for (int x = x_begin; x < x_end; ++x) {
+				int s = 0, v = 0, prev = 0;
+				for (int i = -r; i <= r; ++i) {
+					const int p = ROW(y + i * dy)[x + i * dx];
+					s += p;
+					if (i > -r) v += abs(p - prev);
+					prev = p;
+				}
+				sum[d][x] = s, var[d][x] = v;
+			}
+		}
+
+		// select the direction of the smallest variation and blur
+		short* dstp = luma[1] + (y + 2) * pitch + 8;
+		for (int x = 0; x < loop_w; x += 4)
+		{
+			const __m128 c = _mm_cvtepi32_ps(widen4(load4(c_row + x)));
+			__m128 best_var = _mm_setzero_ps(), best_val = c;
+
+			for (int d = 0; d < 8; ++d)
+			{
+				const __m128 v   = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(var[d] + x))), step_weight[d]);
+				const __m128 s   = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sum[d] + x)));
+				const __m128 val = _mm_add_ps(c, _mm_mul_ps(_mm_sub_ps(s, _mm_mul_ps(c, own_count[d])), blur_weight[d]));
+
+				if (d == 0) {
+					best_var = v;
+					best_val = val;
+				} else {
+					const __m128 less = _mm_cmplt_ps(v, best_var);
+					best_var = _mm_min_ps(v, best_var);
+					best_val = _mm_or_ps(_mm_and_ps(less, val), _mm_andnot_ps(less, best_val));
+				}
+			}
+
+			const __m128i out = _mm_cvtps_epi32(best_val);
+			_mm_storel_epi64((__m128i*)(dstp + x), _mm_packs_epi32(out, out));
+		}
+	}
+
+#undef ROW
+
+	// vertical reflection
+	if (y_start <= 1 && 1 < y_end)
+		memcpy(luma[1] + pitch, luma[1] + 3 * pitch, pitch * sizeof(short));
+	if (y_start <= 2 && 2 < y_end)
+		memcpy(luma[1],         luma[1] + 4 * pitch, pitch * sizeof(short));
+	if (y_start <= height - 3 && height - 3 < y_end)
+		memcpy(luma[1] + (height + 3) * pitch, luma[1] + (height - 1) * pitch, pitch * sizeof(short));
+	if (y_start <= height - 2 && height - 2 < y_end)
+		memcpy(luma[1] + (height + 2) * pitch, luma[1] +  height      * pitch, pitch * sizeof(short));
+}
@@ -0,0 +1,76 @@
+//------------------------------------------------------------------------------
+//		subbands.cpp
+//------------------------------------------------------------------------------
+
+/*
+	Subbands of restoring for other filters (output="subbands").
+
+	The asm CDF 5/3 of restoring (see wavelet.cpp) leaves the coefficients of the restored luma in its buffers:
+		OrigApprox() : approximation (of the original, or blended with that of the blurred image by restore)
+		bufx[1]      : horizontal details of the vertical approximation of the blurred image
+		bufy[1]      : vertical details of the blurred image (not transformed horizontally)
+	Since the inverse transform is exact, they are the subbands of luma[1] after restoring, and they are
+	copied below the filtered frame instead of transforming the output again:
+		filtered frame (w x h)
+		---------------------------------------------------------
+		LL (ceil(w/2) x ceil(h/2)) | HL (floor(w/2) x ceil(h/2))
+		---------------------------------------------------------
+		vertical details (w x floor(h/2))
+	The approximation keeps the scale of the samples, and the detail coefficients are biased by 128.
+
+	buffers
+		OrigApprox(), bufx[1] : 8 rows interleaved (the k-th 8 samples of a row group are column k of its 8 rows)
+		work                  : a deinterleaved row
+*/
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+// a row of 8 interleaved rows -> contiguous samples
+static inline void Deinterleave(short* dstp, const short* srcp, int n)
+{
+	for (int x = 0; x < n; ++x) dstp[x] = srcp[8 * x];
+}
+
+// 12-bit coefficients -> 8-bit samples of a band (+ bias)
+static inline void StoreBand(BYTE* dstp, const short* srcp, int n, int bias)
+{
+	const __m128i round = _mm_set1_epi16(8);
+	const __m128i b = _mm_set1_epi16(bias);
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		const __m128i v = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(srcp + x)), round), 4), b);
+		_mm_storel_epi64((__m128i*)(dstp + x), _mm_packus_epi16(v, v));
+	}
+	for (; x < n; ++x) {
+		const int v = ((srcp[x] + 8) >> 4) + bias;
+		dstp[x] = v < 0 ? 0 : v > 255 ? 255 : v;
+	}
+}
+
+// coefficients of restoring -> luma below the filtered frame
+void MosquitoNR::Subbands(int thread_id)
+{
+	const int half_h = (height + 1) / 2;
+	const int y_start = half_h *  thread_id      / threads;
+	const int y_end   = half_h * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int pitch = this->pitch;
+	const int dst_pitch = dst->GetPitch();
+	const int ne = (width + 1) / 2, no = width / 2;
+	const short* approx = OrigApprox();
+	short* row = work[thread_id];
+	BYTE* dstp = DstLuma() + frame_height * dst_pitch;
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		const int offset = y / 8 * 4 * pitch + 8 + y % 8;
+		Deinterleave(row, approx + offset, ne);
+		StoreBand(dstp + y * dst_pitch, row, ne, 0);
+		Deinterleave(row, bufx[1] + offset, no);
+		StoreBand(dstp + y * dst_pitch + ne, row, no, 128);
+
+		if (y < height / 2)
+			StoreBand(dstp + (half_h + y) * dst_pitch, bufy[1] + (y + 1) * pitch + 8, width, 128);
+	}
+}
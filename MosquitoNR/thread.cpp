@@ -22,6 +22,7 @@ unsigned __stdcall RunThread(void* arg)
 MTInfo::MTInfo()
 {
 	threads = 0;
+	pending = false;
 
 	for (int i = 0; i < MAX_THREADS; ++i) {
 		th[i].job_start    = NULL;
@@ -70,11 +71,27 @@ bool MTInfo::CreateThreads(int _threads, MosquitoNR* inst)
 
 void MTInfo::ExecMTFunc(MTFunc mt_func)
 {
+	StartMTFunc(mt_func);
+	WaitMTFunc();
+}
+
+// run mt_func on the threads without waiting (the calling thread can do other work meanwhile)
+void MTInfo::StartMTFunc(MTFunc mt_func)
+{
+	WaitMTFunc();
+
 	for (int i = 0; i < threads; ++i) {
 		th[i].mt_func = mt_func;
 		SetEvent(th[i].job_start);
 	}
+	pending = true;
+}
+
+void MTInfo::WaitMTFunc()
+{
+	if (!pending) return;
 
 	for (int i = 0; i < threads; ++i)
 		WaitForSingleObject(th[i].job_finished, INFINITE);
+	pending = false;
 }
@@ -0,0 +1,65 @@
+//------------------------------------------------------------------------------
+//		variants.cpp
+//------------------------------------------------------------------------------
+
+/*
+	Several strength/restore settings from one analysis.
+
+	The direction of the blur does not depend on strength, and the blurred pixel moves
+	from the original linearly with strength. Restoring is linear in the difference between
+	the original and the blurred image. So when the frame is analyzed once with strength=32
+	and restore=128 (blurred B, restored R, original O), the output of any setting is
+		out = O + s / 32 * ((B - O) - r / 128 * (B - R))
+	which is one pass per variant. Only rounding differs from a separate run.
+
+	buffers
+		luma[0]     : original
+		var_blur    : blurred with strength=32
+		var_restore : restored with restore=128 (swapped with luma[1] after the analysis)
+		luma[1]     : output of the variant (read by the output stages)
+*/
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+// blurred luma -> var_blur (restoring overwrites luma[1])
+void MosquitoNR::SaveBlur(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+
+	memcpy(var_blur + (y_start + 2) * pitch, luma[1] + (y_start + 2) * pitch, (y_end - y_start) * pitch * sizeof(short));
+}
+
+// O + s / 32 * ((B - O) - r / 128 * (B - R)) -> luma[1]
+void MosquitoNR::SynthesizeVariant(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int s = variant_strength[variant], r = variant_restore[variant];
+	const __m128i weight = _mm_set1_epi32(128 * s | (unsigned)(-r * s) << 16);	// [128s, -rs] for pmaddwd
+	const __m128i round  = _mm_set1_epi32(1 << 11);
+	const __m128i max12  = _mm_set1_epi16(4095);
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		const short* o = luma[0]     + (y + 2) * pitch + 8;
+		const short* b = var_blur    + (y + 2) * pitch + 8;
+		const short* q = var_restore + (y + 2) * pitch + 8;
+		short* dstp = luma[1] + (y + 2) * pitch + 8;
+
+		for (int x = 0; x < width; x += 8) {
+			const __m128i vo = _mm_load_si128((const __m128i*)(o + x));
+			const __m128i vb = _mm_load_si128((const __m128i*)(b + x));
+			const __m128i vq = _mm_load_si128((const __m128i*)(q + x));
+			const __m128i blur_diff = _mm_sub_epi16(vb, vo);
+			const __m128i rest_diff = _mm_sub_epi16(vb, vq);
+			const __m128i lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(blur_diff, rest_diff), weight), round), 12);
+			const __m128i hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(blur_diff, rest_diff), weight), round), 12);
+			const __m128i v  = _mm_add_epi16(vo, _mm_packs_epi32(lo, hi));
+			_mm_store_si128((__m128i*)(dstp + x), _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()), max12));
+		}
+	}
+}
@@ -50,9 +50,11 @@ void MosquitoNR::WaveletVert1(int thread_id)
 	const int width = this->width;
 	const int pitch = this->pitch;
 	const int hloop = (width + 7) / 8;
+	const INT_PTR pf = prefetch;
 
 	for (int y = y_start; y < y_end; y += 8)
 	{
+		if (strip_forward && !strip_forward[y / 8]) continue;	// not read by the strips that are restored
 		short* srcp = luma[0] + y * pitch + 8;
 		short* dstp = bufy[0] + y / 2 * pitch + 8;
 
@@ -80,6 +82,16 @@ next8columns:
 			psubw		xmm0, xmm2
 			add			esi, ebx
 
+			cmp			pf, 0				// prefetch=0: no prefetch
+			je			no_prefetch1
+			add			rsi, pf				// prefetch rows 3-6 of the columns ahead
+			prefetcht0	[rsi]
+			prefetcht0	[rsi+rax]
+			prefetcht0	[rsi+2*rax]
+			prefetcht0	[rsi+rbx]
+			sub			rsi, pf
+no_prefetch1:
+
 			movdqa		xmm2, [rsi]
 			movdqa		xmm3, [rsi+rax]
 			movdqa		xmm4, [rsi+2*rax]
@@ -102,6 +114,16 @@ next8columns:
 			movdqa		[rdi+rax], xmm7
 			lea			rsi, [rsi+4*rax]
 
+			cmp			pf, 0				// prefetch=0: no prefetch
+			je			no_prefetch2
+			add			rsi, pf				// prefetch rows 7-10 of the columns ahead
+			prefetcht0	[rsi]
+			prefetcht0	[rsi+rax]
+			prefetcht0	[rsi+2*rax]
+			prefetcht0	[rsi+rbx]
+			sub			rsi, pf
+no_prefetch2:
+
 			movdqa		xmm0, [rsi]
 			movdqa		xmm1, [rsi+rax]
 			movdqa		xmm2, [rsi+2*rax]
@@ -154,8 +176,9 @@ void MosquitoNR::WaveletHorz1(int thread_id)
 
 	for (int y = y_start; y < y_end; y += 8)
 	{
+		if (strip_horz && !strip_horz[y / 8]) continue;	// not read by the strips that are restored
 		short* srcp = bufy[0] + y * pitch + 4;
-		short* dstp = luma[0] + y / 2 * pitch + 8;
+		short* dstp = OrigApprox() + y / 2 * pitch + 8;
 
 		__asm
 		{
@@ -260,6 +283,7 @@ no_reflection:								// }
 	}
 }
 
+template<bool STREAM>
 void MosquitoNR::WaveletVert2(int thread_id)
 {
 	const int y_start = (height + 7) / 8 *  thread_id      / threads * 8;
@@ -268,95 +292,224 @@ void MosquitoNR::WaveletVert2(int thread_id)
 	const int width = this->width;
 	const int pitch = this->pitch;
 	const int hloop = (width + 7) / 8;
+	const INT_PTR pf = prefetch;
 
 	for (int y = y_start; y < y_end; y += 8)
 	{
+		if (strip_forward && !strip_forward[y / 8]) continue;
 		short* srcp = luma[1] + y * pitch + 8;
 		short* dstp1 = bufy[0] +  y / 2      * pitch + 8;
 		short* dstp2 = bufy[1] + (y / 2 + 1) * pitch + 8;
 
-		__asm
-		{
-			mov			rsi, srcp			// esi = srcp
-			mov			rdi, dstp1			// edi = dstp1
-			mov			rdx, dstp2			// edx = dstp2
-			mov			eax, pitch
-			mov			ecx, hloop			// ecx = hloop
-			add			eax, eax			// eax = pitch * sizeof(short)
-			lea			ebx, [eax+2*eax]	// ebx = pitch * sizeof(short) * 3
+		if (STREAM) {
+			// detail coefficients are not read until InvWaveletVert, so they bypass the cache
+			__asm
+			{
+				mov			rsi, srcp			// esi = srcp
+				mov			rdi, dstp1			// edi = dstp1
+				mov			rdx, dstp2			// edx = dstp2
+				mov			eax, pitch
+				mov			ecx, hloop			// ecx = hloop
+				add			eax, eax			// eax = pitch * sizeof(short)
+				lea			ebx, [eax+2*eax]	// ebx = pitch * sizeof(short) * 3
 
 align 16
-next8columns:
+next8columns_nt:
 #if !defined(_WIN64)
-			push		esi
+				push		esi
 #else
-			mov			r12, rsi
+				mov			r12, rsi
 #endif
-			movdqa		xmm2, [rsi]
-			movdqa		xmm0, [rsi+rax]
-			movdqa		xmm1, [rsi+2*rax]
-			paddw		xmm2, xmm1
-			psraw		xmm2, 1
-			psubw		xmm0, xmm2
-			add			rsi, rbx
+				movdqa		xmm2, [rsi]
+				movdqa		xmm0, [rsi+rax]
+				movdqa		xmm1, [rsi+2*rax]
+				paddw		xmm2, xmm1
+				psraw		xmm2, 1
+				psubw		xmm0, xmm2
+				add			rsi, rbx
+
+				cmp			pf, 0				// prefetch=0: no prefetch
+				je			no_prefetch1_nt
+				add			rsi, pf
+				prefetcht0	[rsi]
+				prefetcht0	[rsi+rax]
+				prefetcht0	[rsi+2*rax]
+				prefetcht0	[rsi+rbx]
+				sub			rsi, pf
+no_prefetch1_nt:
+
+				movdqa		xmm2, [rsi]
+				movdqa		xmm3, [rsi+rax]
+				movdqa		xmm4, [rsi+2*rax]
+				movdqa		xmm5, [rsi+rbx]
+				movdqa		xmm6, xmm1
+				movdqa		xmm7, xmm3
+				paddw		xmm1, xmm3
+				paddw		xmm3, xmm5
+				psraw		xmm1, 1
+				psraw		xmm3, 1
+				psubw		xmm2, xmm1
+				psubw		xmm4, xmm3
+				movntdq		[rdx], xmm2
+				movntdq		[rdx+rax], xmm4
+				paddw		xmm0, xmm2
+				paddw		xmm2, xmm4
+				psraw		xmm0, 2
+				psraw		xmm2, 2
+				paddw		xmm6, xmm0
+				paddw		xmm7, xmm2
+				movdqa		[rdi], xmm6
+				movdqa		[rdi+rax], xmm7
+				lea			rsi, [rsi+4*rax]
+
+				cmp			pf, 0				// prefetch=0: no prefetch
+				je			no_prefetch2_nt
+				add			rsi, pf
+				prefetcht0	[rsi]
+				prefetcht0	[rsi+rax]
+				prefetcht0	[rsi+2*rax]
+				prefetcht0	[rsi+rbx]
+				sub			rsi, pf
+no_prefetch2_nt:
+
+				movdqa		xmm0, [rsi]
+				movdqa		xmm1, [rsi+rax]
+				movdqa		xmm2, [rsi+2*rax]
+				movdqa		xmm3, [rsi+rbx]
+				movdqa		xmm6, xmm5
+				movdqa		xmm7, xmm1
+				paddw		xmm5, xmm1
+				paddw		xmm1, xmm3
+				psraw		xmm5, 1
+				psraw		xmm1, 1
+				psubw		xmm0, xmm5
+				psubw		xmm2, xmm1
+				movntdq		[rdx+2*rax], xmm0
+				movntdq		[rdx+rbx], xmm2
+				paddw		xmm4, xmm0
+				paddw		xmm0, xmm2
+				psraw		xmm4, 2
+				psraw		xmm0, 2
+				paddw		xmm6, xmm4
+				paddw		xmm7, xmm0
+				movdqa		[rdi+2*rax], xmm6
+				movdqa		[rdi+rbx], xmm7
 
-			movdqa		xmm2, [rsi]
-			movdqa		xmm3, [rsi+rax]
-			movdqa		xmm4, [rsi+2*rax]
-			movdqa		xmm5, [rsi+rbx]
-			movdqa		xmm6, xmm1
-			movdqa		xmm7, xmm3
-			paddw		xmm1, xmm3
-			paddw		xmm3, xmm5
-			psraw		xmm1, 1
-			psraw		xmm3, 1
-			psubw		xmm2, xmm1
-			psubw		xmm4, xmm3
-			movdqa		[rdx], xmm2
-			movdqa		[rdx+rax], xmm4
-			paddw		xmm0, xmm2
-			paddw		xmm2, xmm4
-			psraw		xmm0, 2
-			psraw		xmm2, 2
-			paddw		xmm6, xmm0
-			paddw		xmm7, xmm2
-			movdqa		[rdi], xmm6
-			movdqa		[rdi+rax], xmm7
-			lea			rsi, [rsi+4*rax]
+#if !defined(_WIN64)
+				pop			esi
+#else
+				mov			rsi, r12
+#endif
+				add			rsi, 16
+				add			rdi, 16
+				add			rdx, 16
+				sub			ecx, 1
+				jnz			next8columns_nt
+			}
+		} else {
+			__asm
+			{
+				mov			rsi, srcp			// esi = srcp
+				mov			rdi, dstp1			// edi = dstp1
+				mov			rdx, dstp2			// edx = dstp2
+				mov			eax, pitch
+				mov			ecx, hloop			// ecx = hloop
+				add			eax, eax			// eax = pitch * sizeof(short)
+				lea			ebx, [eax+2*eax]	// ebx = pitch * sizeof(short) * 3
 
-			movdqa		xmm0, [rsi]
-			movdqa		xmm1, [rsi+rax]
-			movdqa		xmm2, [rsi+2*rax]
-			movdqa		xmm3, [rsi+rbx]
-			movdqa		xmm6, xmm5
-			movdqa		xmm7, xmm1
-			paddw		xmm5, xmm1
-			paddw		xmm1, xmm3
-			psraw		xmm5, 1
-			psraw		xmm1, 1
-			psubw		xmm0, xmm5
-			psubw		xmm2, xmm1
-			movdqa		[rdx+2*rax], xmm0
-			movdqa		[rdx+rbx], xmm2
-			paddw		xmm4, xmm0
-			paddw		xmm0, xmm2
-			psraw		xmm4, 2
-			psraw		xmm0, 2
-			paddw		xmm6, xmm4
-			paddw		xmm7, xmm0
-			movdqa		[rdi+2*rax], xmm6
-			movdqa		[rdi+rbx], xmm7
+align 16
+next8columns:
+#if !defined(_WIN64)
+				push		esi
+#else
+				mov			r12, rsi
+#endif
+				movdqa		xmm2, [rsi]
+				movdqa		xmm0, [rsi+rax]
+				movdqa		xmm1, [rsi+2*rax]
+				paddw		xmm2, xmm1
+				psraw		xmm2, 1
+				psubw		xmm0, xmm2
+				add			rsi, rbx
+
+				cmp			pf, 0				// prefetch=0: no prefetch
+				je			no_prefetch1
+				add			rsi, pf				// prefetch rows 3-6 of the columns ahead
+				prefetcht0	[rsi]
+				prefetcht0	[rsi+rax]
+				prefetcht0	[rsi+2*rax]
+				prefetcht0	[rsi+rbx]
+				sub			rsi, pf
+no_prefetch1:
+
+				movdqa		xmm2, [rsi]
+				movdqa		xmm3, [rsi+rax]
+				movdqa		xmm4, [rsi+2*rax]
+				movdqa		xmm5, [rsi+rbx]
+				movdqa		xmm6, xmm1
+				movdqa		xmm7, xmm3
+				paddw		xmm1, xmm3
+				paddw		xmm3, xmm5
+				psraw		xmm1, 1
+				psraw		xmm3, 1
+				psubw		xmm2, xmm1
+				psubw		xmm4, xmm3
+				movdqa		[rdx], xmm2
+				movdqa		[rdx+rax], xmm4
+				paddw		xmm0, xmm2
+				paddw		xmm2, xmm4
+				psraw		xmm0, 2
+				psraw		xmm2, 2
+				paddw		xmm6, xmm0
+				paddw		xmm7, xmm2
+				movdqa		[rdi], xmm6
+				movdqa		[rdi+rax], xmm7
+				lea			rsi, [rsi+4*rax]
+
+				cmp			pf, 0				// prefetch=0: no prefetch
+				je			no_prefetch2
+				add			rsi, pf				// prefetch rows 7-10 of the columns ahead
+				prefetcht0	[rsi]
+				prefetcht0	[rsi+rax]
+				prefetcht0	[rsi+2*rax]
+				prefetcht0	[rsi+rbx]
+				sub			rsi, pf
+no_prefetch2:
+
+				movdqa		xmm0, [rsi]
+				movdqa		xmm1, [rsi+rax]
+				movdqa		xmm2, [rsi+2*rax]
+				movdqa		xmm3, [rsi+rbx]
+				movdqa		xmm6, xmm5
+				movdqa		xmm7, xmm1
+				paddw		xmm5, xmm1
+				paddw		xmm1, xmm3
+				psraw		xmm5, 1
+				psraw		xmm1, 1
+				psubw		xmm0, xmm5
+				psubw		xmm2, xmm1
+				movdqa		[rdx+2*rax], xmm0
+				movdqa		[rdx+rbx], xmm2
+				paddw		xmm4, xmm0
+				paddw		xmm0, xmm2
+				psraw		xmm4, 2
+				psraw		xmm0, 2
+				paddw		xmm6, xmm4
+				paddw		xmm7, xmm0
+				movdqa		[rdi+2*rax], xmm6
+				movdqa		[rdi+rbx], xmm7
 
 #if !defined(_WIN64)
-			pop			esi
+				pop			esi
 #else
-			mov			rsi, r12
+				mov			rsi, r12
 #endif
-			add			rsi, 16
-			add			rdi, 16
-			add			rdx, 16
-			sub			ecx, 1
-			jnz			next8columns
+				add			rsi, 16
+				add			rdi, 16
+				add			rdx, 16
+				sub			ecx, 1
+				jnz			next8columns
+			}
 		}
 
 		// horizontal reflection
@@ -365,6 +518,10 @@ next8columns:
 			p[-2] = p[2], p[-1] = p[1], p[width] = p[width-2], p[width+1] = p[width-3];
 	}
 
+	if (STREAM) {
+		__asm sfence
+	}
+
 	// vertical reflection
 	if (y_start == 0)
 		memcpy(bufy[1], bufy[1] + pitch, pitch * sizeof(short));
@@ -372,6 +529,9 @@ next8columns:
 		memcpy(bufy[1] + (height / 2 + 1) * pitch, bufy[1] + (height / 2 - 1) * pitch, pitch * sizeof(short));
 }
 
+template void MosquitoNR::WaveletVert2<false>(int thread_id);
+template void MosquitoNR::WaveletVert2<true >(int thread_id);
+
 void MosquitoNR::WaveletHorz2(int thread_id)
 {
 	const int y_start = (height + 15) / 16 *  thread_id      / threads * 8;
@@ -385,6 +545,7 @@ void MosquitoNR::WaveletHorz2(int thread_id)
 
 	for (int y = y_start; y < y_end; y += 8)
 	{
+		if (strip_horz && !strip_horz[y / 8]) continue;
 		short* srcp = bufy[0] + y * pitch + 4;
 		short* dstp = bufx[1] + y / 2 * pitch + 8;
 
@@ -508,6 +669,7 @@ void MosquitoNR::WaveletHorz3(int thread_id)
 
 	for (int y = y_start; y < y_end; y += 8)
 	{
+		if (strip_horz && !strip_horz[y / 8]) continue;
 		short* srcp = bufy[0] + y * pitch + 4;
 		short* dstp1 = bufx[0] + y / 2 * pitch + 8;
 		short* dstp2 = bufx[1] + y / 2 * pitch + 8;
@@ -624,52 +786,51 @@ no_reflection:								// }
 
 void MosquitoNR::BlendCoef(int thread_id)
 {
-	const int y_start = ((height + 15) &~ 15) / 4 *  thread_id      / threads;
-	const int y_end   = ((height + 15) &~ 15) / 4 * (thread_id + 1) / threads;
+	const int y_start = (height + 15) / 16 *  thread_id      / threads * 8;
+	const int y_end   = (height + 15) / 16 * (thread_id + 1) / threads * 8;
 	if (y_start == y_end) return;
 	const int pitch = this->pitch;
-	const int multiplier = ((128 - restore) << 16) + restore;
-	short *dstp = luma[0], *srcp = bufx[0];
+	const int multiplier = this->multiplier;
 
-	__asm
+	// 4 rows of the shuffled coefficients for each 8 rows of bufy
+	for (int y = y_start; y < y_end; y += 8)
 	{
-		mov			rdi, dstp
-		mov			rsi, srcp
-		mov			eax, pitch
-		mov			ebx, y_start
-		mov			ecx, y_end
-		add			eax, eax			// eax = pitch * sizeof(short)
-		sub			ecx, ebx
-		imul		ebx, eax			// ebx = y_start * pitch * sizeof(short)
-		imul		ecx, eax
-		add			rdi, rbx			// edi = luma[0] + y_start * pitch
-		add			rsi, rbx			// esi = bufx[0] + y_start * pitch
-		shr			ecx, 4				// ecx = (y_end - y_start) * pitch / 8
-		movd		xmm6, multiplier
-		pshufd		xmm6, xmm6, 0		// xmm6 = [128 - restore, restore] * 4
-		mov			edx, 64
-		movd		xmm7, edx
-		pshufd		xmm7, xmm7, 0		// xmm7 = [64] * 4
+		if (strip_horz && !strip_horz[y / 8]) continue;
+		short* dstp = OrigApprox() + y / 2 * pitch;
+		short* srcp = bufx[0]      + y / 2 * pitch;
+
+		__asm
+		{
+			mov			rdi, dstp
+			mov			rsi, srcp
+			mov			ecx, pitch
+			shr			ecx, 1				// ecx = 4 * pitch / 8
+			movd		xmm6, multiplier
+			pshufd		xmm6, xmm6, 0		// xmm6 = [128 - restore, restore] * 4
+			mov			edx, 64
+			movd		xmm7, edx
+			pshufd		xmm7, xmm7, 0		// xmm7 = [64] * 4
 
 align 16
 next8pixels:
-		movdqa		xmm0, [rdi]			// d7, d6, d5, d4, d3, d2, d1, d0
-		movdqa		xmm2, [rsi]			// s7, s6, s5, s4, s3, s2, s1, s0
-		movdqa		xmm1, xmm0
-		punpcklwd	xmm0, xmm2			// s3, d3, s2, d2, s1, d1, s0, d0
-		punpckhwd	xmm1, xmm2			// s7, d7, s6, d6, s5, d5, s4, d4
-		pmaddwd		xmm0, xmm6
-		pmaddwd		xmm1, xmm6
-		paddd		xmm0, xmm7
-		paddd		xmm1, xmm7
-		psrad		xmm0, 7
-		psrad		xmm1, 7
-		packssdw	xmm0, xmm1
-		movdqa		[rdi], xmm0
-		add			rdi, 16
-		add			rsi, 16
-		sub			ecx, 1
-		jnz			next8pixels
+			movdqa		xmm0, [rdi]			// d7, d6, d5, d4, d3, d2, d1, d0
+			movdqa		xmm2, [rsi]			// s7, s6, s5, s4, s3, s2, s1, s0
+			movdqa		xmm1, xmm0
+			punpcklwd	xmm0, xmm2			// s3, d3, s2, d2, s1, d1, s0, d0
+			punpckhwd	xmm1, xmm2			// s7, d7, s6, d6, s5, d5, s4, d4
+			pmaddwd		xmm0, xmm6
+			pmaddwd		xmm1, xmm6
+			paddd		xmm0, xmm7
+			paddd		xmm1, xmm7
+			psrad		xmm0, 7
+			psrad		xmm1, 7
+			packssdw	xmm0, xmm1
+			movdqa		[rdi], xmm0
+			add			rdi, 16
+			add			rsi, 16
+			sub			ecx, 1
+			jnz			next8pixels
+		}
 	}
 }
 
@@ -685,7 +846,8 @@ void MosquitoNR::InvWaveletHorz(int thread_id)
 
 	for (int y = y_start; y < y_end; y += 8)
 	{
-		short* srcp1 = luma[0] + y / 2 * pitch + 8;
+		if (strip_horz && !strip_horz[y / 8]) continue;
+		short* srcp1 = OrigApprox() + y / 2 * pitch + 8;
 		short* srcp2 = bufx[1] + y / 2 * pitch + 8;
 		short* dstp = bufy[0] + y * pitch + 8;
 
@@ -795,9 +957,17 @@ void MosquitoNR::InvWaveletVert(int thread_id)
 	const int y_end   = (height + 7) / 8 * (thread_id + 1) / threads * 8;
 	if (y_start == y_end) return;
 	const int pitch  = this->pitch;
+	const INT_PTR pf = prefetch;
 
 	for (int y = y_start; y < y_end; y += 8)
 	{
+		const int rows = min(8, height - y);
+		if (strip_action && strip_action[y / 8] != STRIP_RUN) {
+			// luma[1] is the output already, or the previous frame restored the same
+			if (strip_action[y / 8] == STRIP_REUSE)
+				memcpy(luma[1] + (y + 2) * pitch, prev_restored + (y + 2) * pitch, rows * pitch * sizeof(short));
+			continue;
+		}
 		int hloop = (width + 7) / 8;
 		short* srcp1 = bufy[0] + y / 2 * pitch + 8;
 		short* srcp2 = bufy[1] + y / 2 * pitch + 8;
@@ -820,6 +990,21 @@ next8columns:
 #else
 			mov			r13, rdi
 #endif
+			cmp			pf, 0				// prefetch=0: no prefetch
+			je			no_prefetch
+			add			rsi, pf				// prefetch rows 1-4 of srcp1 and 2-5 of srcp2 ahead
+			add			rdx, pf
+			prefetcht0	[rsi+rax]
+			prefetcht0	[rsi+2*rax]
+			prefetcht0	[rsi+rbx]
+			prefetcht0	[rsi+4*rax]
+			prefetcht0	[rdx+2*rax]
+			prefetcht0	[rdx+rbx]
+			prefetcht0	[rdx+4*rax]
+			prefetcht0	[rdx+rcx]
+			sub			rsi, pf
+			sub			rdx, pf
+no_prefetch:
 			movdqa		xmm2, [rdx]
 			movdqa		xmm0, [rsi]
 			movdqa		xmm1, [rdx+rax]
@@ -885,5 +1070,9 @@ next8columns:
 			sub			hloop, 1
 			jnz			next8columns
 		}
+
+		// for the strips of the next frame whose blocks are all reused
+		if (incremental)
+			memcpy(prev_restored + (y + 2) * pitch, luma[1] + (y + 2) * pitch, rows * pitch * sizeof(short));
 	}
 }
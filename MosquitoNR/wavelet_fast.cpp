@@ -0,0 +1,172 @@
+//------------------------------------------------------------------------------
+//		wavelet_fast.cpp
+//------------------------------------------------------------------------------
+
+/*
+	Restoring of the fast mode in 8-bit lanes.
+
+	Instead of CDF 5/3 wavelet, the difference between the original and the blurred image
+	is reduced twice by 2x2 averages and enlarged twice by linear interpolation (the inverse
+	transform without detail coefficients), then added to the blurred image.
+	The difference is stored as 128 + (original - blurred) / 2, so it fits in unsigned bytes.
+
+	buffers (byte samples in the buffers of the precise path, pitch = pitch * sizeof(short))
+		luma[0] : original (with reflected borders)
+		luma[1] : blurred
+		bufy[0] : level 1 of the difference
+		bufx[0] : level 2 of the difference
+		bufy[1] : level 2 enlarged to level 1
+*/
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+// halve a row (tmp[width] must be a copy of tmp[width-1])
+static inline void ShrinkRow(BYTE* dstp, const BYTE* tmp, int dst_width)
+{
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+
+	for (int x = 0; x < dst_width; x += 16) {
+		const __m128i a = _mm_loadu_si128((const __m128i*)(tmp + 2 * x));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(tmp + 2 * x + 16));
+		const __m128i lo = _mm_avg_epu16(_mm_and_si128(a, mask), _mm_srli_epi16(a, 8));
+		const __m128i hi = _mm_avg_epu16(_mm_and_si128(b, mask), _mm_srli_epi16(b, 8));
+		_mm_store_si128((__m128i*)(dstp + x), _mm_packus_epi16(lo, hi));
+	}
+}
+
+// double a row (tmp[width] must be a copy of tmp[width-1])
+static inline void EnlargeRow(BYTE* dstp, const BYTE* tmp, int src_width)
+{
+	for (int x = 0; x < src_width; x += 16) {
+		const __m128i a   = _mm_loadu_si128((const __m128i*)(tmp + x));
+		const __m128i avg = _mm_avg_epu8(a, _mm_loadu_si128((const __m128i*)(tmp + x + 1)));
+		_mm_storeu_si128((__m128i*)(dstp + 2 * x),      _mm_unpacklo_epi8(a, avg));
+		_mm_storeu_si128((__m128i*)(dstp + 2 * x + 16), _mm_unpackhi_epi8(a, avg));
+	}
+}
+
+// vertical linear interpolation of row y from rows of the half height
+static inline void InterpolateRow(BYTE* tmp, const BYTE* srcp, int src_pitch, int src_width, int src_height, int y)
+{
+	const BYTE* a = srcp + y / 2 * src_pitch;
+	const BYTE* b = y / 2 + 1 < src_height ? a + src_pitch : a;
+
+	for (int x = 0; x < src_width; x += 16) {
+		const __m128i va = _mm_load_si128((const __m128i*)(a + x));
+		_mm_store_si128((__m128i*)(tmp + x), y % 2 == 0 ? va : _mm_avg_epu8(va, _mm_load_si128((const __m128i*)(b + x))));
+	}
+	tmp[src_width] = tmp[src_width-1];
+}
+
+// LEVEL 1: original, blurred -> bufy[0], LEVEL 2: bufy[0] -> bufx[0]
+template<int LEVEL>
+void MosquitoNR::DownsampleFast(int thread_id)
+{
+	const int src_w = LEVEL == 1 ? width  : (width  + 1) / 2;
+	const int src_h = LEVEL == 1 ? height : (height + 1) / 2;
+	const int dst_w = (src_w + 1) / 2;
+	const int dst_h = (src_h + 1) / 2;
+	const int y_start = dst_h *  thread_id      / threads;
+	const int y_end   = dst_h * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int pitch = this->pitch * sizeof(short);
+	const __m128i inv = _mm_set1_epi8(-1);
+	BYTE* tmp = reinterpret_cast<BYTE*>(work[thread_id]);
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		const int y1 = 2 * y, y2 = min(2 * y + 1, src_h - 1);
+
+		if (LEVEL == 1) {
+			const BYTE* o1 = reinterpret_cast<BYTE*>(luma[0]) + (y1 + 2) * pitch + 16;
+			const BYTE* o2 = reinterpret_cast<BYTE*>(luma[0]) + (y2 + 2) * pitch + 16;
+			const BYTE* b1 = reinterpret_cast<BYTE*>(luma[1]) + (y1 + 2) * pitch + 16;
+			const BYTE* b2 = reinterpret_cast<BYTE*>(luma[1]) + (y2 + 2) * pitch + 16;
+			for (int x = 0; x < src_w; x += 16) {
+				// 128 + (original - blurred) / 2
+				const __m128i d1 = _mm_avg_epu8(_mm_load_si128((const __m128i*)(o1 + x)),
+					_mm_xor_si128(_mm_load_si128((const __m128i*)(b1 + x)), inv));
+				const __m128i d2 = _mm_avg_epu8(_mm_load_si128((const __m128i*)(o2 + x)),
+					_mm_xor_si128(_mm_load_si128((const __m128i*)(b2 + x)), inv));
+				_mm_store_si128((__m128i*)(tmp + x), _mm_avg_epu8(d1, d2));
+			}
+		} else {
+			const BYTE* s1 = reinterpret_cast<BYTE*>(bufy[0]) + y1 * pitch;
+			const BYTE* s2 = reinterpret_cast<BYTE*>(bufy[0]) + y2 * pitch;
+			for (int x = 0; x < src_w; x += 16)
+				_mm_store_si128((__m128i*)(tmp + x),
+					_mm_avg_epu8(_mm_load_si128((const __m128i*)(s1 + x)), _mm_load_si128((const __m128i*)(s2 + x))));
+		}
+		tmp[src_w] = tmp[src_w-1];
+
+		ShrinkRow(reinterpret_cast<BYTE*>(LEVEL == 1 ? bufy[0] : bufx[0]) + y * pitch, tmp, dst_w);
+	}
+}
+
+template void MosquitoNR::DownsampleFast<1>(int thread_id);
+template void MosquitoNR::DownsampleFast<2>(int thread_id);
+
+// bufx[0] -> bufy[1]
+void MosquitoNR::UpsampleFast(int thread_id)
+{
+	const int dst_w = (width  + 1) / 2;
+	const int dst_h = (height + 1) / 2;
+	const int y_start = dst_h *  thread_id      / threads;
+	const int y_end   = dst_h * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int pitch = this->pitch * sizeof(short);
+	BYTE* tmp = reinterpret_cast<BYTE*>(work[thread_id]);
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		InterpolateRow(tmp, reinterpret_cast<BYTE*>(bufx[0]), pitch, (dst_w + 1) / 2, (dst_h + 1) / 2, y);
+		EnlargeRow(reinterpret_cast<BYTE*>(bufy[1]) + y * pitch, tmp, (dst_w + 1) / 2);
+	}
+}
+
+// blurred + restore / 128 * (enlarged difference - 128) * 2 -> output frame
+void MosquitoNR::RestoreFast(int thread_id)
+{
+	const int y_start = height *  thread_id      / threads;
+	const int y_end   = height * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int width  = this->width;
+	const int pitch  = this->pitch * sizeof(short);
+	const int weight = restore;
+	const __m128i bias = _mm_set1_epi8(-128);
+	const __m128i zero = _mm_setzero_si128();
+	BYTE* tmp  = reinterpret_cast<BYTE*>(work[thread_id]);
+	BYTE* diff = tmp + pitch;
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		InterpolateRow(tmp, reinterpret_cast<BYTE*>(bufy[1]), pitch, (width + 1) / 2, (height + 1) / 2, y);
+		EnlargeRow(diff, tmp, (width + 1) / 2);
+
+		const BYTE* blur = reinterpret_cast<BYTE*>(luma[1]) + (y + 2) * pitch + 16;
+		BYTE* dstp = DstLuma() + y * dst->GetPitch();
+
+		for (int x = 0; x < width; x += 16)
+		{
+			const __m128i d = _mm_load_si128((const __m128i*)(diff + x));
+			__m128i pos = _mm_subs_epu8(d, bias);
+			__m128i neg = _mm_subs_epu8(bias, d);
+			pos = _mm_adds_epu8(pos, pos);
+			neg = _mm_adds_epu8(neg, neg);
+
+			// scaled by restore / 128 (steps below the lowest set bit do nothing)
+			if (weight < 128) {
+				__m128i p = zero, n = zero;
+				for (int bit = weight & -weight; 0 < bit && bit < 128; bit <<= 1) {
+					p = _mm_avg_epu8(p, weight & bit ? pos : zero);
+					n = _mm_avg_epu8(n, weight & bit ? neg : zero);
+				}
+				pos = p, neg = n;
+			}
+
+			const __m128i b = _mm_load_si128((const __m128i*)(blur + x));
+			_mm_store_si128((__m128i*)(dstp + x), _mm_subs_epu8(_mm_adds_epu8(b, pos), neg));
+		}
+	}
+}
@@ -0,0 +1,159 @@
+//------------------------------------------------------------------------------
+//		wavelet_float.cpp
+//------------------------------------------------------------------------------
+
+/*
+	CDF 5/3 wavelet for float input.
+
+	Only the approximation coefficients are needed for restoring, and without rounding
+	the lifting steps of the forward transform are equal to a low-pass filter:
+		a[i] = (-x[2i-2] + 2 * x[2i-1] + 6 * x[2i] + 2 * x[2i+1] - x[2i+2]) / 8
+	The inverse transform with all detail coefficients set to zero is a linear interpolation:
+		x[2i] = a[i], x[2i+1] = (a[i] + a[i+1]) / 2
+
+	Since the transform is linear, the difference between the original and the blurred image
+	is decomposed, and its interpolated level-2 approximation is added to the blurred image.
+	The result is the same as replacing the approximation coefficients of the blurred image.
+*/
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+// LEVEL 1: original - blurred -> fbuf[0], LEVEL 2: fbuf[0] -> fbuf[1]
+template<int LEVEL>
+void MosquitoNR::WaveletFloat(int thread_id)
+{
+	const int src_w = LEVEL == 1 ? width  : (width  + 1) / 2;
+	const int src_h = LEVEL == 1 ? height : (height + 1) / 2;
+	const int dst_w = (src_w + 1) / 2;
+	const int dst_h = (src_h + 1) / 2;
+	const int y_start = dst_h *  thread_id      / threads;
+	const int y_end   = dst_h * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int pitch = this->pitch;
+	const __m128 c0 = _mm_set1_ps( 0.75f);
+	const __m128 c1 = _mm_set1_ps( 0.25f);
+	const __m128 c2 = _mm_set1_ps(-0.125f);
+	float* tmp = fwork[thread_id] + 8;
+	float* dstbuf = fbuf[LEVEL-1];
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		// vertical
+		if (LEVEL == 1) {
+			const float* p = fluma[0] + (2 * y + 2) * pitch + 8;
+			const float* q = fluma[1] + (2 * y + 2) * pitch + 8;
+			for (int x = 0; x < src_w; x += 4) {
+				const __m128 d0 = _mm_sub_ps(_mm_load_ps(p + x - 2 * pitch), _mm_load_ps(q + x - 2 * pitch));
+				const __m128 d1 = _mm_sub_ps(_mm_load_ps(p + x -     pitch), _mm_load_ps(q + x -     pitch));
+				const __m128 d2 = _mm_sub_ps(_mm_load_ps(p + x            ), _mm_load_ps(q + x            ));
+				const __m128 d3 = _mm_sub_ps(_mm_load_ps(p + x +     pitch), _mm_load_ps(q + x +     pitch));
+				const __m128 d4 = _mm_sub_ps(_mm_load_ps(p + x + 2 * pitch), _mm_load_ps(q + x + 2 * pitch));
+				_mm_store_ps(tmp + x, _mm_add_ps(_mm_mul_ps(d2, c0),
+					_mm_add_ps(_mm_mul_ps(_mm_add_ps(d1, d3), c1), _mm_mul_ps(_mm_add_ps(d0, d4), c2))));
+			}
+		} else {
+			const float* p = fbuf[0] + (2 * y + 2) * pitch + 8;
+			for (int x = 0; x < src_w; x += 4) {
+				const __m128 d0 = _mm_load_ps(p + x - 2 * pitch);
+				const __m128 d1 = _mm_load_ps(p + x -     pitch);
+				const __m128 d2 = _mm_load_ps(p + x            );
+				const __m128 d3 = _mm_load_ps(p + x +     pitch);
+				const __m128 d4 = _mm_load_ps(p + x + 2 * pitch);
+				_mm_store_ps(tmp + x, _mm_add_ps(_mm_mul_ps(d2, c0),
+					_mm_add_ps(_mm_mul_ps(_mm_add_ps(d1, d3), c1), _mm_mul_ps(_mm_add_ps(d0, d4), c2))));
+			}
+		}
+
+		// horizontal reflection
+		tmp[-2] = tmp[2], tmp[-1] = tmp[1], tmp[src_w] = tmp[src_w-2], tmp[src_w+1] = tmp[src_w-3];
+
+		// horizontal (even/odd columns are separated by shuffles)
+		float* dstp = dstbuf + (y + 2) * pitch + 8;
+		for (int x = 0; x < dst_w; x += 4) {
+			const __m128 l0 = _mm_loadu_ps(tmp + 2 * x - 2);
+			const __m128 l1 = _mm_loadu_ps(tmp + 2 * x + 2);
+			const __m128 l2 = _mm_loadu_ps(tmp + 2 * x + 6);
+			const __m128 even_m = _mm_shuffle_ps(l0, l1, _MM_SHUFFLE(2, 0, 2, 0));	// [2x-2], [2x], ...
+			const __m128 odd_m  = _mm_shuffle_ps(l0, l1, _MM_SHUFFLE(3, 1, 3, 1));	// [2x-1], [2x+1], ...
+			const __m128 even_p = _mm_shuffle_ps(l1, l2, _MM_SHUFFLE(2, 0, 2, 0));	// [2x+2], [2x+4], ...
+			const __m128 odd_p  = _mm_shuffle_ps(l1, l2, _MM_SHUFFLE(3, 1, 3, 1));	// [2x+3], [2x+5], ...
+			const __m128 even   = _mm_shuffle_ps(even_m, even_p, _MM_SHUFFLE(2, 1, 2, 1));	// [2x], [2x+2], ...
+			const __m128 odd    = _mm_shuffle_ps(odd_m,  odd_p,  _MM_SHUFFLE(2, 1, 2, 1));	// [2x+1], [2x+3], ...
+			_mm_store_ps(dstp + x, _mm_add_ps(_mm_mul_ps(even, c0),
+				_mm_add_ps(_mm_mul_ps(_mm_add_ps(odd_m, odd), c1), _mm_mul_ps(_mm_add_ps(even_m, even_p), c2))));
+		}
+	}
+
+	// vertical reflection
+	if (y_start <= 1 && 1 < y_end)
+		memcpy(dstbuf + pitch, dstbuf + 3 * pitch, pitch * sizeof(float));
+	if (y_start <= 2 && 2 < y_end)
+		memcpy(dstbuf,         dstbuf + 4 * pitch, pitch * sizeof(float));
+	if (y_start <= dst_h - 3 && dst_h - 3 < y_end)
+		memcpy(dstbuf + (dst_h + 3) * pitch, dstbuf + (dst_h - 1) * pitch, pitch * sizeof(float));
+	if (y_start <= dst_h - 2 && dst_h - 2 < y_end)
+		memcpy(dstbuf + (dst_h + 2) * pitch, dstbuf +  dst_h      * pitch, pitch * sizeof(float));
+}
+
+// LEVEL 2: fbuf[1] -> fbuf[0], LEVEL 1: blurred + restore * fbuf[0] -> output frame
+template<int LEVEL>
+void MosquitoNR::InvWaveletFloat(int thread_id)
+{
+	const int dst_w = LEVEL == 1 ? width  : (width  + 1) / 2;
+	const int dst_h = LEVEL == 1 ? height : (height + 1) / 2;
+	const int src_w = (dst_w + 1) / 2;
+	const int src_h = (dst_h + 1) / 2;
+	const int y_start = dst_h *  thread_id      / threads;
+	const int y_end   = dst_h * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int pitch = this->pitch;
+	const float w = restore / 128.0f;
+	const __m128 half   = _mm_set1_ps(0.5f);
+	const __m128 weight = _mm_set1_ps(w);
+	float* tmp = fwork[thread_id] + 8;
+	const float* src = fbuf[LEVEL-1];
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		// vertical
+		const float* p = src + (y / 2 + 2) * pitch + 8;
+		if (y % 2 == 0) {
+			memcpy(tmp, p, src_w * sizeof(float));
+		} else {
+			const float* q = y / 2 + 1 < src_h ? p + pitch : p;
+			for (int x = 0; x < src_w; x += 4)
+				_mm_store_ps(tmp + x, _mm_mul_ps(_mm_add_ps(_mm_load_ps(p + x), _mm_load_ps(q + x)), half));
+		}
+		tmp[src_w] = tmp[src_w-1];
+
+		// horizontal (interleaved with the averages of the neighbors)
+		float* dstp;
+		const float* blur = fluma[1] + (y + 2) * pitch + 8;
+		if (LEVEL == 1) dstp = reinterpret_cast<float*>(DstLuma() + y * dst->GetPitch());
+		else            dstp = fbuf[0] + (y + 2) * pitch + 8;
+
+		int x = 0;
+		for (; 2 * x + 8 <= dst_w; x += 4) {
+			const __m128 a   = _mm_loadu_ps(tmp + x);
+			const __m128 avg = _mm_mul_ps(_mm_add_ps(a, _mm_loadu_ps(tmp + x + 1)), half);
+			__m128 lo = _mm_unpacklo_ps(a, avg);
+			__m128 hi = _mm_unpackhi_ps(a, avg);
+			if (LEVEL == 1) {
+				lo = _mm_add_ps(_mm_loadu_ps(blur + 2 * x    ), _mm_mul_ps(lo, weight));
+				hi = _mm_add_ps(_mm_loadu_ps(blur + 2 * x + 4), _mm_mul_ps(hi, weight));
+			}
+			_mm_storeu_ps(dstp + 2 * x,     lo);
+			_mm_storeu_ps(dstp + 2 * x + 4, hi);
+		}
+		for (x *= 2; x < dst_w; ++x) {
+			const float v = x % 2 == 0 ? tmp[x/2] : (tmp[x/2] + tmp[x/2+1]) * 0.5f;
+			dstp[x] = LEVEL == 1 ? blur[x] + v * w : v;
+		}
+	}
+}
+
+template void MosquitoNR::WaveletFloat<1>(int thread_id);
+template void MosquitoNR::WaveletFloat<2>(int thread_id);
+template void MosquitoNR::InvWaveletFloat<1>(int thread_id);
+template void MosquitoNR::InvWaveletFloat<2>(int thread_id);
@@ -0,0 +1,282 @@
+//------------------------------------------------------------------------------
+//		wavelet_lifting.cpp
+//------------------------------------------------------------------------------
+
+/*
+	Lifting engine for the wavelets and the depths other than the asm CDF 5/3 of 2 levels,
+	4 samples at a time in float.
+
+	A wavelet is a list of lifting steps
+		x[i] += a * x[i-1] + b * x[i+1]
+	which update odd samples (predict) on even steps and even samples (update) on odd steps,
+	with whole-sample symmetric extension at both ends. The scaling of the approximation is
+	left out, because it is canceled by the inverse transform.
+
+	As in wavelet_float.cpp, the difference between the original and the blurred image is decomposed,
+	and its inverse transform is added to the blurred image. Before the inverse transform, the approximation
+	is scaled by restore / 128, and the detail coefficients of each level by restore1 / 128 (level 1) or
+	restore2 / 128 (level 2 and deeper). The detail coefficients are dropped when the weight is 0.
+	All 3 detail subbands of a level share the weight, so the horizontal details are scaled without
+	the vertical transform.
+
+	buffers
+		lift[l]  : horizontal approximation of level l-1 (lift_h[l-1] rows, lift_w[l] columns)
+		           after the vertical pass, its even rows are the approximation of level l,
+		           and its odd rows are the vertical details
+		liftd[l] : horizontal details of level l-1 (only for a weight other than 0)
+		fwork    : a row, and its even/odd samples
+*/
+
+#include <emmintrin.h>
+#include "mosquito_nr.h"
+
+template<int WAVELET> struct Lifting;
+
+template<> struct Lifting<WAVELET_HAAR>
+{
+	enum { STEPS = 2 };
+	static const float a[STEPS], b[STEPS];
+};
+const float Lifting<WAVELET_HAAR>::a[] = { -1.0f, 0.0f };
+const float Lifting<WAVELET_HAAR>::b[] = {  0.0f, 0.5f };
+
+template<> struct Lifting<WAVELET_53>
+{
+	enum { STEPS = 2 };
+	static const float a[STEPS], b[STEPS];
+};
+const float Lifting<WAVELET_53>::a[] = { -0.5f, 0.25f };
+const float Lifting<WAVELET_53>::b[] = { -0.5f, 0.25f };
+
+template<> struct Lifting<WAVELET_97>
+{
+	enum { STEPS = 4 };
+	static const float a[STEPS], b[STEPS];
+};
+const float Lifting<WAVELET_97>::a[] = { -1.586134342f, -0.05298011854f, 0.8829110762f, 0.4435068522f };
+const float Lifting<WAVELET_97>::b[] = { -1.586134342f, -0.05298011854f, 0.8829110762f, 0.4435068522f };
+
+static inline int reflect(int i, int n)
+{
+	return i < 0 ? -i : i >= n ? 2 * n - 2 - i : i;
+}
+
+// weight of the detail coefficients of a level
+float MosquitoNR::DetailWeight(int level) const
+{
+	return (level == 1 ? restore1 : restore2) / 128.0f;
+}
+
+// one lifting step on separated samples of a row (INVERSE: subtracted)
+template<int WAVELET, bool INVERSE>
+static inline void LiftStep(float* even, float* odd, int n, int step)
+{
+	const int ne = (n + 1) / 2, no = n / 2;
+	const __m128 a = _mm_set1_ps(Lifting<WAVELET>::a[step]);
+	const __m128 b = _mm_set1_ps(Lifting<WAVELET>::b[step]);
+
+	if (step % 2 == 0) {
+		// odd[i] += a * even[i] + b * even[i+1]
+		if (n % 2 == 0) even[ne] = even[ne-1];
+		for (int i = 0; i < no; i += 4) {
+			const __m128 t = _mm_add_ps(_mm_mul_ps(_mm_load_ps(even + i), a), _mm_mul_ps(_mm_loadu_ps(even + i + 1), b));
+			const __m128 o = _mm_load_ps(odd + i);
+			_mm_store_ps(odd + i, INVERSE ? _mm_sub_ps(o, t) : _mm_add_ps(o, t));
+		}
+	} else {
+		// even[i] += a * odd[i-1] + b * odd[i]
+		odd[-1] = odd[0];
+		if (n % 2 != 0) odd[no] = odd[no-1];
+		for (int i = 0; i < ne; i += 4) {
+			const __m128 t = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(odd + i - 1), a), _mm_mul_ps(_mm_load_ps(odd + i), b));
+			const __m128 e = _mm_load_ps(even + i);
+			_mm_store_ps(even + i, INVERSE ? _mm_sub_ps(e, t) : _mm_add_ps(e, t));
+		}
+	}
+}
+
+// one lifting step on rows [x_start, x_end) of a plane of n rows
+template<int WAVELET, bool INVERSE>
+static inline void LiftStepVert(float* p, int pitch, int n, int x_start, int x_end, int step)
+{
+	const __m128 a = _mm_set1_ps(Lifting<WAVELET>::a[step]);
+	const __m128 b = _mm_set1_ps(Lifting<WAVELET>::b[step]);
+
+	// odd rows from even rows on even steps, even rows from odd rows on odd steps
+	for (int y = 1 - step % 2; y < n; y += 2) {
+		float* q = p + y * pitch;
+		const float* u = p + reflect(y - 1, n) * pitch;
+		const float* d = p + reflect(y + 1, n) * pitch;
+		for (int x = x_start; x < x_end; x += 4) {
+			const __m128 t = _mm_add_ps(_mm_mul_ps(_mm_load_ps(u + x), a), _mm_mul_ps(_mm_load_ps(d + x), b));
+			const __m128 v = _mm_load_ps(q + x);
+			_mm_store_ps(q + x, INVERSE ? _mm_sub_ps(v, t) : _mm_add_ps(v, t));
+		}
+	}
+}
+
+// lift_level - 1 -> lift[lift_level] (horizontal)
+template<int WAVELET>
+void MosquitoNR::LiftForwardHorz(int thread_id)
+{
+	const int level = lift_level;
+	const int src_w = lift_w[level-1], src_h = lift_h[level-1];
+	const int ne = (src_w + 1) / 2;
+	const int y_start = src_h *  thread_id      / threads;
+	const int y_end   = src_h * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int pitch = this->pitch;
+	float* row  = fwork[thread_id] + 4;
+	float* even = row  + pitch;
+	float* odd  = even + pitch;
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		// original - blurred, or the approximation of the previous level
+		const float* srcp;
+		if (level > 1) {
+			srcp = lift[level-1] + 2 * y * pitch;
+		} else if (bits == 32) {
+			const float* p = fluma[0] + (y + 2) * pitch + 8;
+			const float* q = fluma[1] + (y + 2) * pitch + 8;
+			for (int x = 0; x < src_w; x += 4)
+				_mm_store_ps(row + x, _mm_sub_ps(_mm_load_ps(p + x), _mm_load_ps(q + x)));
+			srcp = row;
+		} else {
+			const short* p = luma[0] + (y + 2) * pitch + 8;
+			const short* q = luma[1] + (y + 2) * pitch + 8;
+			for (int x = 0; x < src_w; x += 8) {
+				const __m128i d = _mm_sub_epi16(_mm_load_si128((const __m128i*)(p + x)), _mm_load_si128((const __m128i*)(q + x)));
+				_mm_store_ps(row + x,     _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16)));
+				_mm_store_ps(row + x + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(d, d), 16)));
+			}
+			srcp = row;
+		}
+
+		// even/odd samples
+		for (int x = 0; x < ne; x += 4) {
+			const __m128 l0 = _mm_loadu_ps(srcp + 2 * x);
+			const __m128 l1 = _mm_loadu_ps(srcp + 2 * x + 4);
+			_mm_store_ps(even + x, _mm_shuffle_ps(l0, l1, _MM_SHUFFLE(2, 0, 2, 0)));
+			_mm_store_ps(odd  + x, _mm_shuffle_ps(l0, l1, _MM_SHUFFLE(3, 1, 3, 1)));
+		}
+
+		if (src_w > 1)
+			for (int step = 0; step < Lifting<WAVELET>::STEPS; ++step)
+				LiftStep<WAVELET, false>(even, odd, src_w, step);
+
+		memcpy(lift[level] + y * pitch, even, ne * sizeof(float));
+		if (liftd[level]) memcpy(liftd[level] + y * pitch, odd, src_w / 2 * sizeof(float));
+	}
+}
+
+// lift[lift_level] (vertical, in place)
+template<int WAVELET>
+void MosquitoNR::LiftForwardVert(int thread_id)
+{
+	const int level = lift_level;
+	const int n = lift_h[level-1];
+	const int blocks = (lift_w[level] + 3) / 4;
+	const int x_start = 4 * (blocks *  thread_id      / threads);
+	const int x_end   = 4 * (blocks * (thread_id + 1) / threads);
+	if (x_start == x_end || n < 2) return;
+
+	for (int step = 0; step < Lifting<WAVELET>::STEPS; ++step)
+		LiftStepVert<WAVELET, false>(lift[level], pitch, n, x_start, x_end, step);
+}
+
+// even rows of lift[lift_level] and weighted odd rows -> all rows (vertical, in place)
+template<int WAVELET>
+void MosquitoNR::LiftInverseVert(int thread_id)
+{
+	const int level = lift_level;
+	const int n = lift_h[level-1];
+	const int blocks = (lift_w[level] + 3) / 4;
+	const int x_start = 4 * (blocks *  thread_id      / threads);
+	const int x_end   = 4 * (blocks * (thread_id + 1) / threads);
+	if (x_start == x_end) return;
+	const __m128 approx = _mm_set1_ps(restore / 128.0f);
+	const __m128 detail = _mm_set1_ps(DetailWeight(level));
+
+	// the approximation of the deepest level, and the detail coefficients
+	for (int y = level == levels ? 0 : 1; y < n; y += level == levels ? 1 : 2) {
+		float* p = lift[level] + y * pitch;
+		const __m128 w = y % 2 == 0 ? approx : detail;
+		for (int x = x_start; x < x_end; x += 4)
+			_mm_store_ps(p + x, _mm_mul_ps(_mm_load_ps(p + x), w));
+	}
+	if (n < 2) return;
+
+	for (int step = Lifting<WAVELET>::STEPS - 1; step >= 0; --step)
+		LiftStepVert<WAVELET, true>(lift[level], pitch, n, x_start, x_end, step);
+}
+
+// lift[lift_level] and weighted liftd[lift_level] -> even rows of lift[lift_level-1],
+// or blurred + difference -> luma[1]
+template<int WAVELET>
+void MosquitoNR::LiftInverseHorz(int thread_id)
+{
+	const int level = lift_level;
+	const int dst_w = lift_w[level-1], dst_h = lift_h[level-1];
+	const int ne = (dst_w + 1) / 2;
+	const int y_start = dst_h *  thread_id      / threads;
+	const int y_end   = dst_h * (thread_id + 1) / threads;
+	if (y_start == y_end) return;
+	const int pitch = this->pitch;
+	const __m128 weight = _mm_set1_ps(DetailWeight(level));
+	const __m128i max12 = _mm_set1_epi16(4095);
+	float* row  = fwork[thread_id] + 4;
+	float* even = row  + pitch;
+	float* odd  = even + pitch;
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		memcpy(even, lift[level] + y * pitch, ne * sizeof(float));
+		if (liftd[level]) {
+			const float* d = liftd[level] + y * pitch;
+			for (int x = 0; x < dst_w / 2; x += 4)
+				_mm_store_ps(odd + x, _mm_mul_ps(_mm_load_ps(d + x), weight));
+		} else {
+			memset(odd, 0, ne * sizeof(float));
+		}
+
+		if (dst_w > 1)
+			for (int step = Lifting<WAVELET>::STEPS - 1; step >= 0; --step)
+				LiftStep<WAVELET, true>(even, odd, dst_w, step);
+
+		float* dstp = level > 1 ? lift[level-1] + 2 * y * pitch : row;
+		for (int x = 0; x < ne; x += 4) {
+			const __m128 e = _mm_load_ps(even + x);
+			const __m128 o = _mm_load_ps(odd  + x);
+			_mm_storeu_ps(dstp + 2 * x,     _mm_unpacklo_ps(e, o));
+			_mm_storeu_ps(dstp + 2 * x + 4, _mm_unpackhi_ps(e, o));
+		}
+		if (level > 1) continue;
+
+		// add to the blurred image
+		if (bits == 32) {
+			float* q = fluma[1] + (y + 2) * pitch + 8;
+			for (int x = 0; x < dst_w; x += 4)
+				_mm_store_ps(q + x, _mm_add_ps(_mm_load_ps(q + x), _mm_load_ps(row + x)));
+		} else {
+			short* q = luma[1] + (y + 2) * pitch + 8;
+			for (int x = 0; x < dst_w; x += 8) {
+				const __m128i lo = _mm_cvtps_epi32(_mm_load_ps(row + x));
+				const __m128i hi = _mm_cvtps_epi32(_mm_load_ps(row + x + 4));
+				__m128i v = _mm_adds_epi16(_mm_load_si128((const __m128i*)(q + x)), _mm_packs_epi32(lo, hi));
+				v = _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()), max12);
+				_mm_store_si128((__m128i*)(q + x), v);
+			}
+		}
+	}
+}
+
+#define INSTANTIATE(wavelet) \
+	template void MosquitoNR::LiftForwardHorz<wavelet>(int thread_id); \
+	template void MosquitoNR::LiftForwardVert<wavelet>(int thread_id); \
+	template void MosquitoNR::LiftInverseVert<wavelet>(int thread_id); \
+	template void MosquitoNR::LiftInverseHorz<wavelet>(int thread_id);
+INSTANTIATE(WAVELET_HAAR)
+INSTANTIATE(WAVELET_53)
+INSTANTIATE(WAVELET_97)
+#undef INSTANTIATE